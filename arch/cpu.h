@@ -19,4 +19,82 @@ static inline void cpu_relax(void) {
     __asm__ volatile("pause");
 }
 
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(subleaf));
+}
+
+// Initial APIC ID of the executing CPU (CPUID leaf 1, EBX[31:24])
+static inline uint32_t cpu_apic_id(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    return ebx >> 24;
+}
+
+// Read the time-stamp counter
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline uint64_t read_cr0(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr0" :: "r"(value) : "memory");
+}
+
+// Faulting address of the last page fault
+static inline uint64_t read_cr2(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr3" :: "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr4" :: "r"(value) : "memory");
+}
+
+// Upper bound on CPUs that per-CPU data is sized for
+#define MAX_CPUS 16
+
+// Index of the executing CPU. Only the BSP runs today, so this is 0 until
+// application processors are brought up and given their own indices.
+static inline uint32_t cpu_current_id(void) {
+    return 0;
+}
+
+// Disable interrupts and return the previous RFLAGS for cpu_irq_restore()
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) :: "memory");
+    return rflags;
+}
+
+static inline void cpu_irq_restore(uint64_t rflags) {
+    __asm__ volatile("push %0; popfq" :: "r"(rflags) : "memory", "cc");
+}
+
 #endif
\ No newline at end of file
@@ -1,10 +1,14 @@
 #include "gdt.h"
 #include "../lib/printk.h"
 
-// GDT entries
-static struct gdt_entry gdt[5];
+// GDT entries: 5 segments, then the TSS descriptor (which takes two)
+#define GDT_ENTRIES 7
+static struct gdt_entry gdt[GDT_ENTRIES];
 static struct gdt_ptr gdt_pointer;
 
+static struct tss tss;
+static uint8_t double_fault_stack[IST_STACK_SIZE] __attribute__((aligned(16)));
+
 // External assembly function to load GDT
 extern void gdt_flush(uint64_t gdt_ptr);
 
@@ -21,8 +25,23 @@ static void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access,
     gdt[num].access = access;
 }
 
+// Set the 16-byte TSS descriptor at entries 5-6
+static void gdt_set_tss(void) {
+    uint64_t base = (uint64_t)&tss;
+
+    tss.ist[IST_DOUBLE_FAULT - 1] = (uint64_t)double_fault_stack + IST_STACK_SIZE;
+    tss.iomap_base = sizeof(struct tss);    // No I/O permission bitmap
+
+    // Access: Present, Ring 0, 64-bit available TSS
+    gdt_set_gate(5, (uint32_t)base, sizeof(struct tss) - 1, 0x89, 0x00);
+    // The upper half holds bits 32-63 of the base
+    uint32_t* high = (uint32_t*)&gdt[6];
+    high[0] = (uint32_t)(base >> 32);
+    high[1] = 0;
+}
+
 void gdt_init(void) {
-    gdt_pointer.limit = (sizeof(struct gdt_entry) * 5) - 1;
+    gdt_pointer.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
     gdt_pointer.base = (uint64_t)&gdt;
     
     // Null descriptor (required)
@@ -43,9 +62,13 @@ void gdt_init(void) {
     
     // User data segment (64-bit) - for later
     gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+
+    // Task state segment, for the interrupt stack table
+    gdt_set_tss();
     
-    // Load the GDT
+    // Load the GDT and the task register
     gdt_flush((uint64_t)&gdt_pointer);
+    __asm__ volatile("ltr %w0" :: "r"(GDT_TSS_SELECTOR));
     
     printk("[GDT] Global Descriptor Table initialized\n");
 }
\ No newline at end of file
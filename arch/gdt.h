@@ -13,6 +13,25 @@ struct gdt_entry {
     uint8_t base_high;
 } __attribute__((packed));
 
+// 64-bit Task State Segment. Only the interrupt stack table is used.
+struct tss {
+    uint32_t reserved0;
+    uint64_t rsp[3];        // Stacks for privilege changes (unused)
+    uint64_t reserved1;
+    uint64_t ist[7];        // IST1-IST7
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+#define GDT_TSS_SELECTOR    0x28
+
+// Interrupt stack table slot for the double fault handler: a kernel stack
+// overflow faults again pushing the #PF frame, and the #DF still needs a
+// stack that works
+#define IST_DOUBLE_FAULT    1
+#define IST_STACK_SIZE      16384
+
 // GDT pointer structure
 struct gdt_ptr {
     uint16_t limit;
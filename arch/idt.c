@@ -1,9 +1,13 @@
 #include "idt.h"
 #include "apic.h"
+#include "gdt.h"
 #include "../lib/printk.h"
 #include "../lib/string.h"
+#include "../lib/panic.h"
 #include "../drivers/keyboard.h"
 #include "../drivers/timer.h"
+#include "../mm/vmm.h"
+#include "../kernel/sched.h"
 
 uint64_t irq_handler(uint64_t irq_number, uint64_t current_rsp);
 
@@ -67,7 +71,7 @@ static void idt_set_gate(uint8_t num, uint64_t handler, uint16_t selector, uint8
     idt[num].offset_high = (handler >> 32) & 0xFFFFFFFF;
     
     idt[num].selector = selector;
-    idt[num].ist = 0;  // No IST for now
+    idt[num].ist = 0;  // Interrupted stack
     idt[num].type_attr = flags;
     idt[num].zero = 0;
 }
@@ -104,6 +108,9 @@ void idt_init(void) {
     idt_set_gate(20, (uint64_t)isr20, 0x08, 0x8E);
     idt_set_gate(21, (uint64_t)isr21, 0x08, 0x8E);
     idt_set_gate(31, (uint64_t)isr31, 0x08, 0x8E);
+
+    // Double faults run on their own stack (see gdt.h)
+    idt[8].ist = IST_DOUBLE_FAULT;
     
     // Set up IRQ handlers (IRQs 0-15 mapped to interrupts 32-47)
     idt_set_gate(32, (uint64_t)irq0, 0x08, 0x8E);
@@ -157,6 +164,27 @@ static const char *exception_messages[] = {
 
 // Common exception handler (called from assembly)
 void isr_handler(uint64_t isr_number, uint64_t error_code) {
+    // Page faults in demand-paged memory are resolved and retried
+    uint64_t fault_addr = 0;
+    if (isr_number == 14) {
+        fault_addr = read_cr2();
+        if (vmm_handle_fault(fault_addr, error_code)) {
+            return;
+        }
+    }
+
+    // A thread running off its stack hits the guard page below it. The #PF
+    // frame cannot be pushed there either, so that arrives as a double
+    // fault, with CR2 still in the guard page.
+    if (isr_number == 8 || isr_number == 14) {
+        uint64_t addr = read_cr2();
+        int thread = sched_stack_guard_owner(addr);
+        if (thread >= 0) {
+            printk("\n[SCHED] Thread %d overflowed its stack (fault at 0x%llx)\n", thread, addr);
+            panic("Kernel stack overflow");
+        }
+    }
+
     printk("\n=== EXCEPTION ===\n");
     printk("Exception: %s (ISR %lld)\n", 
            isr_number < 22 ? exception_messages[isr_number] : "Unknown",
@@ -165,6 +193,9 @@ void isr_handler(uint64_t isr_number, uint64_t error_code) {
     if (error_code != 0) {
         printk("Error Code: 0x%llx\n", error_code);
     }
+    if (isr_number == 14) {
+        printk("Faulting Address: 0x%llx\n", fault_addr);
+    }
     
     printk("\nSystem Halted.\n");
     
@@ -1,6 +1,7 @@
 #include "framebuffer.h"
 #include "../lib/string.h"
 #include "../mm/heap.h"
+#include "../mm/vmm.h"
 #include "../lib/printk.h"
 
 static framebuffer_t fb;
@@ -19,7 +20,8 @@ void fb_init(uint32_t *addr, size_t width, size_t height, size_t pitch, uint16_t
 void fb_enable_double_buffering(void) {
     size_t buffer_size = fb.height * fb.pitch;
     
-    fb.backbuffer = (uint32_t*)kmalloc(buffer_size);
+    // Cache-line aligned, so fb_swap() reads whole lines
+    fb.backbuffer = (uint32_t*)kmalloc_aligned(buffer_size, 64);
     if (!fb.backbuffer) {
         printk("[FB] WARNING: Failed to allocate backbuffer. Falling back to MMIO.\n");
         fb.backbuffer = fb.address; 
@@ -29,6 +31,11 @@ void fb_enable_double_buffering(void) {
     }
 }
 
+void fb_set_memory_type(uint64_t type) {
+    vmm_remap_range(vmm_get_kernel_pml4(), (uint64_t)fb.address, fb.height * fb.pitch,
+                    PTE_PRESENT | PTE_RW | PTE_NX | type);
+}
+
 // Everything now writes to fb.backbuffer instead of fb.address
 void fb_put_pixel(size_t x, size_t y, uint32_t color) {
     if (x >= fb.width || y >= fb.height) {
@@ -56,8 +63,14 @@ void fb_clear(uint32_t color) {
 void fb_swap(void) {
     if (fb.backbuffer == fb.address) return; // No backbuffer allocated
 
-    // im not sure about this if compilers turn this into sse/avx instructions
-    memcpy(fb.address, fb.backbuffer, fb.height * fb.pitch);
+    // 8 bytes per store; with a WC mapping the CPU merges them into full
+    // cache line bursts
+    size_t bytes = fb.height * fb.pitch;
+    uint64_t* dst = (uint64_t*)fb.address;
+    const uint64_t* src = (const uint64_t*)fb.backbuffer;
+    size_t words = bytes / 8;
+    __asm__ volatile("rep movsq" : "+D"(dst), "+S"(src), "+c"(words) :: "memory");
+    memcpy(dst, src, bytes % 8);
 }
 
 framebuffer_t* fb_get(void) {
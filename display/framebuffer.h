@@ -18,6 +18,10 @@ void fb_enable_double_buffering(void);
 void fb_put_pixel(size_t x, size_t y, uint32_t color);
 void fb_clear(uint32_t color);
 void fb_swap(void);
+
+// Remap the visible framebuffer with a memory type from mm/vmm.h
+// (PTE_WC, PTE_UC)
+void fb_set_memory_type(uint64_t type);
 framebuffer_t* fb_get(void);
 
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "../lib/string.h"
 #include "../lib/printk.h"
 #include "../lib/panic.h"
+#include "../mm/arena.h"
 
 // Request RSDP from Limine
 __attribute__((used, section(".requests")))
@@ -18,6 +19,13 @@ static acpi_sdt_header_t* xsdt = NULL;
 static acpi_sdt_header_t* rsdt = NULL;
 static int use_xsdt = 0;
 
+// Boot arena copies of every table, made by acpi_cache_tables() so the firmware
+// copies can be reclaimed. Lookups use them once they exist.
+#define ACPI_MAX_CACHED_TABLES 64
+static acpi_sdt_header_t* cached_tables[ACPI_MAX_CACHED_TABLES];
+static int cached_count = 0;
+static int tables_cached = 0;
+
 // Helper: Validate Checksum
 static int validate_checksum(void* ptr, size_t length) {
     uint8_t* bytes = (uint8_t*)ptr;
@@ -71,28 +79,42 @@ void acpi_init(void) {
     }
 }
 
-void* acpi_find_table(const char* signature) {
-    acpi_sdt_header_t* header = NULL;
+// Number of tables listed in the XSDT/RSDT
+static int root_table_count(void) {
+    if (use_xsdt) {
+        return (xsdt->length - sizeof(acpi_sdt_header_t)) / 8;
+    }
+    return (rsdt->length - sizeof(acpi_sdt_header_t)) / 4;
+}
 
+// Firmware copy of the i-th table listed in the XSDT/RSDT
+static acpi_sdt_header_t* root_table(int i) {
     if (use_xsdt) {
-        int entries = (xsdt->length - sizeof(acpi_sdt_header_t)) / 8;
         uint64_t* pointers = (uint64_t*)((uint64_t)xsdt + sizeof(acpi_sdt_header_t));
+        return (acpi_sdt_header_t*)p2v(pointers[i]);
+    }
+    uint32_t* pointers = (uint32_t*)((uint64_t)rsdt + sizeof(acpi_sdt_header_t));
+    return (acpi_sdt_header_t*)p2v((uint64_t)pointers[i]);
+}
 
-        for (int i = 0; i < entries; i++) {
-            header = (acpi_sdt_header_t*)p2v(pointers[i]);
+void* acpi_find_table(const char* signature) {
+    acpi_sdt_header_t* header = NULL;
+
+    if (tables_cached) {
+        for (int i = 0; i < cached_count; i++) {
+            header = cached_tables[i];
             if (strncmp(header->signature, signature, 4) == 0) {
                 goto found;
             }
         }
-    } else {
-        int entries = (rsdt->length - sizeof(acpi_sdt_header_t)) / 4;
-        uint32_t* pointers = (uint32_t*)((uint64_t)rsdt + sizeof(acpi_sdt_header_t));
+        return NULL;
+    }
 
-        for (int i = 0; i < entries; i++) {
-            header = (acpi_sdt_header_t*)p2v((uint64_t)pointers[i]);
-            if (strncmp(header->signature, signature, 4) == 0) {
-                goto found;
-            }
+    int entries = root_table_count();
+    for (int i = 0; i < entries; i++) {
+        header = root_table(i);
+        if (strncmp(header->signature, signature, 4) == 0) {
+            goto found;
         }
     }
     return NULL;
@@ -105,6 +127,52 @@ found:
     return (void*)header;
 }
 
+static void cache_table(acpi_sdt_header_t* table) {
+    if (cached_count >= ACPI_MAX_CACHED_TABLES) {
+        printk("[ACPI] Warning: too many tables, not keeping %.4s\n", table->signature);
+        return;
+    }
+
+    acpi_sdt_header_t* copy = (acpi_sdt_header_t*)arena_alloc(&boot_arena, table->length, 0);
+    if (!copy) panic("ACPI: out of memory copying tables");
+    memcpy(copy, table, table->length);
+    cached_tables[cached_count++] = copy;
+}
+
+void acpi_cache_tables(void) {
+    if (tables_cached) return;
+
+    uint64_t bytes = 0;
+    int entries = root_table_count();
+    for (int i = 0; i < entries; i++) {
+        acpi_sdt_header_t* table = root_table(i);
+        cache_table(table);
+        bytes += table->length;
+
+        // The DSDT is reached through the FADT rather than the root table
+        if (strncmp(table->signature, "FACP", 4) == 0) {
+            acpi_fadt_t* fadt = (acpi_fadt_t*)table;
+            uint64_t dsdt_phys = fadt->dsdt;
+            if (fadt->header.length >= offsetof(acpi_fadt_t, x_dsdt) + 8 && fadt->x_dsdt) {
+                dsdt_phys = fadt->x_dsdt;
+            }
+            if (dsdt_phys) {
+                acpi_sdt_header_t* dsdt = (acpi_sdt_header_t*)p2v(dsdt_phys);
+                cache_table(dsdt);
+                bytes += dsdt->length;
+            }
+        }
+    }
+
+    // Nothing may point into firmware memory from here on
+    tables_cached = 1;
+    rsdp = NULL;
+    xsdt = NULL;
+    rsdt = NULL;
+
+    printk("[ACPI] Copied %d tables (%llu bytes) to the boot arena\n", cached_count, bytes);
+}
+
 void acpi_reboot(void) {
     acpi_fadt_t* fadt = (acpi_fadt_t*)acpi_find_table("FACP");
     if (!fadt) {
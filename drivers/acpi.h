@@ -150,12 +150,76 @@ typedef struct {
     // Followed by allocation structures...
 } __attribute__((packed)) acpi_mcfg_t;
 
+// SRAT (System Resource Affinity Table)
+typedef struct {
+    acpi_sdt_header_t header;
+    uint32_t reserved1;     // Must be 1
+    uint64_t reserved2;
+    // Followed by affinity structures...
+} __attribute__((packed)) acpi_srat_t;
+
+// SRAT Entry Types
+#define SRAT_LAPIC_AFFINITY   0
+#define SRAT_MEMORY_AFFINITY  1
+#define SRAT_X2APIC_AFFINITY  2
+
+#define SRAT_ENABLED          (1 << 0)
+
+// Type 0: Processor Local APIC Affinity
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint8_t proximity_domain_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_domain_hi[3];
+    uint32_t clock_domain;
+} __attribute__((packed)) acpi_srat_lapic_t;
+
+// Type 1: Memory Affinity
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base_address;
+    uint64_t length_bytes;
+    uint32_t reserved2;
+    uint32_t flags;         // Bit 0 = Enabled, Bit 1 = Hot Pluggable
+    uint64_t reserved3;
+} __attribute__((packed)) acpi_srat_memory_t;
+
+// Type 2: Processor x2APIC Affinity
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed)) acpi_srat_x2apic_t;
+
+// SLIT (System Locality Information Table)
+typedef struct {
+    acpi_sdt_header_t header;
+    uint64_t locality_count;
+    // Followed by locality_count * locality_count distance bytes
+} __attribute__((packed)) acpi_slit_t;
+
 // Initialize ACPI subsystem
 void acpi_init(void);
 
 // Find a table by signature (e.g., "APIC", "MCFG")
 void* acpi_find_table(const char* signature);
 
+// Copy all tables (and the DSDT) to the boot arena so ACPI reclaimable
+// memory can be returned to the PMM. acpi_find_table() returns the copies
+// afterwards.
+void acpi_cache_tables(void);
+
 // Expose Power Functions
 void acpi_reboot(void);
 void acpi_shutdown(void);
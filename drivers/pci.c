@@ -3,6 +3,8 @@
 #include "../lib/printk.h"
 #include "../mm/vmm.h"
 #include "../mm/pmm.h"
+#include "../mm/vmalloc.h"
+#include "../mm/heap.h"
 
 // MCFG Allocation Structure
 typedef struct {
@@ -13,41 +15,44 @@ typedef struct {
     uint32_t reserved;
 } __attribute__((packed)) mcfg_allocation_t;
 
-// The Device Registry
-#define PCI_MAX_DEVICES 256
-static pci_device_t pci_devices[PCI_MAX_DEVICES];
+// The Device Registry, grown as devices are found
+static pci_device_t* pci_devices = NULL;
+static size_t pci_device_capacity = 0;
 static int pci_device_count = 0;
 
-// Virtual address where we will map ECAM
-// We use a high virtual address far away from the kernel and HHDM
-#define ECAM_VIRT_BASE 0xffffc00000000000
+// Virtual address of bus 0 in the ECAM window of the segment being scanned
+static uint64_t ecam_virt_base = 0;
 
-// Helper to map ECAM physically to Uncacheable Virtual Memory
-static void map_ecam_bus(uint64_t phys_base, uint8_t bus) {
+// Helper to map ECAM physically to Uncacheable Virtual Memory.
+// Returns the address bus 0 would have in the window, or 0 on failure.
+static uint64_t map_ecam_buses(uint64_t phys_base, uint8_t start_bus, uint8_t end_bus) {
     // 1 Bus = 32 Devices * 8 Functions * 4096 Bytes = 1MB
-    uint64_t bus_phys = phys_base + (bus << 20);
-    uint64_t bus_virt = ECAM_VIRT_BASE + (bus << 20);
-
-    // Map 1MB (256 pages) as MMIO (Uncacheable, No Execute)
-    for (int i = 0; i < 256; i++) {
-        vmm_map(vmm_get_kernel_pml4(), 
-                bus_virt + (i * PAGE_SIZE), 
-                bus_phys + (i * PAGE_SIZE), 
-                PTE_MMIO);
-    }
+    uint64_t bus_phys = phys_base + ((uint64_t)start_bus << 20);
+    uint64_t len = (uint64_t)(end_bus - start_bus + 1) << 20;
+
+    // Map the whole range as MMIO (Uncacheable, No Execute) in one go;
+    // ioremap() places it so aligned parts get 2MB pages
+    void* window = ioremap(bus_phys, len, PTE_UC);
+    if (!window) return 0;
+    return (uint64_t)window - ((uint64_t)start_bus << 20);
 }
 
 static void pci_check_device(uint8_t bus, uint8_t device, uint8_t function) {
-    if (pci_device_count >= PCI_MAX_DEVICES) return;
-
     // Calculate virtual ECAM address
     uint64_t offset = ((uint64_t)bus << 20) | ((uint64_t)device << 15) | ((uint64_t)function << 12);
-    volatile pci_device_header_t* hdr = (volatile pci_device_header_t*)(ECAM_VIRT_BASE + offset);
+    volatile pci_device_header_t* hdr = (volatile pci_device_header_t*)(ecam_virt_base + offset);
 
     // Vendor ID 0xFFFF means device doesn't exist
     if (hdr->vendor_id == 0xFFFF) return;
 
     // Register the device
+    pci_device_t* devices = krealloc_array(pci_devices, &pci_device_capacity,
+                                           pci_device_count + 1, sizeof(pci_device_t));
+    if (!devices) {
+        printk("[PCI] Out of memory registering %02x:%02x.%x\n", bus, device, function);
+        return;
+    }
+    pci_devices = devices;
     pci_device_t* dev = &pci_devices[pci_device_count++];
     dev->bus = bus;
     dev->device = device;
@@ -84,11 +89,16 @@ void pci_init(void) {
 
     for (int i = 0; i < entries; i++) {
         uint64_t phys_base = allocs[i].base_address;
+
+        // Map this segment's buses as Uncacheable
+        ecam_virt_base = map_ecam_buses(phys_base, allocs[i].start_bus_number,
+                                        allocs[i].end_bus_number);
+        if (!ecam_virt_base) {
+            printk("[PCI] Cannot map ECAM segment %d\n", i);
+            continue;
+        }
         
         for (uint16_t bus = allocs[i].start_bus_number; bus <= allocs[i].end_bus_number; bus++) {
-            // Map this specific 1MB bus chunk as Uncacheable
-            map_ecam_bus(phys_base, bus);
-            
             for (uint8_t device = 0; device < 32; device++) {
                 pci_check_device(bus, device, 0);
             }
@@ -1,5 +1,5 @@
 #include "vfs.h"
-#include "../mm/heap.h"
+#include "../mm/arena.h"
 #include "../lib/string.h"
 #include "../lib/printk.h"
 
@@ -10,11 +10,15 @@ void vfs_init(void) {
     printk("[VFS] Initialized.\n");
 }
 
+// Nodes are never removed, so they and their names are packed into the
+// boot arena
 void vfs_register_node(const char* name, uint64_t size, bool is_dir, uint8_t* data) {
-    vfs_node_t* node = (vfs_node_t*)kmalloc(sizeof(vfs_node_t));
-    
-    strncpy(node->name, name, MAX_FILENAME - 1);
-    node->name[MAX_FILENAME - 1] = '\0';
+    vfs_node_t* node = (vfs_node_t*)arena_alloc(&boot_arena, sizeof(vfs_node_t), 0);
+    if (node) node->name = arena_strndup(&boot_arena, name, MAX_FILENAME - 1);
+    if (!node || !node->name) {
+        printk("[VFS] Out of memory registering /%s\n", name);
+        return;
+    }
     
     node->size = size;
     node->is_dir = is_dir;
@@ -9,7 +9,7 @@
 
 // Represents a file in our system
 typedef struct vfs_node {
-    char name[MAX_FILENAME];
+    const char* name;
     uint64_t size;
     bool is_dir;
     uint8_t* data; // Pointer to the file's data in RAM
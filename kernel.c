@@ -12,8 +12,10 @@
 #include "drivers/timer.h"
 #include "mm/pmm.h"
 #include "mm/vmm.h"
+#include "mm/numa.h"
 #include "lib/panic.h"
 #include "mm/heap.h"
+#include "mm/vmalloc.h"
 #include "drivers/acpi.h"
 #include "drivers/pci.h"
 #include "kernel/sched.h"
@@ -44,14 +46,89 @@ static volatile struct limine_module_request module_request = {
     .revision = 0
 };
 
+__attribute__((used, section(".requests")))
+static volatile struct limine_kernel_address_request kernel_address_request = {
+    .id = LIMINE_KERNEL_ADDRESS_REQUEST,
+    .revision = 0
+};
+
 uint64_t hhdm_offset = 0;
 
+// Where Limine loaded the kernel image; 0 if it did not say
+uint64_t kernel_phys_base = 0;
+
 static struct limine_memmap_response *memmap_response = NULL;
 
+// The bootloader's memory map lives in memory we reclaim later,
+// so the kernel works from its own copy
+#define MEMMAP_MAX_ENTRIES 256
+static struct limine_memmap_entry memmap_entries[MEMMAP_MAX_ENTRIES];
+static struct limine_memmap_entry* memmap_entry_ptrs[MEMMAP_MAX_ENTRIES];
+static struct limine_memmap_response memmap_copy;
+
+// Frames cleared per idle loop iteration, with interrupts off
+#define ZERO_POOL_IDLE_BATCH 8
+// Heap pages unmapped per idle loop iteration, likewise
+#define HEAP_TRIM_IDLE_BATCH 64
+
 struct limine_memmap_response* get_memory_map(void) {
     return memmap_response;
 }
 
+static struct limine_memmap_response* copy_memory_map(struct limine_memmap_response* boot) {
+    uint64_t count = boot->entry_count;
+    if (count > MEMMAP_MAX_ENTRIES) {
+        printk("[KERNEL] Warning: memory map has %llu entries, keeping %d\n",
+               count, MEMMAP_MAX_ENTRIES);
+        count = MEMMAP_MAX_ENTRIES;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        memmap_entries[i] = *boot->entries[i];
+        memmap_entry_ptrs[i] = &memmap_entries[i];
+    }
+    memmap_copy.revision = boot->revision;
+    memmap_copy.entry_count = count;
+    memmap_copy.entries = memmap_entry_ptrs;
+    return &memmap_copy;
+}
+
+// Return bootloader- and ACPI-reclaimable memory to the PMM. Everything the
+// kernel still needs from there must have been copied out by now: the memory
+// map (above), the ACPI tables (acpi_cache_tables) and the boot page tables
+// (vmm_init). The region holding the boot stack we are running on is kept.
+static void reclaim_boot_memory(void) {
+    acpi_cache_tables();
+
+    uint64_t rsp;
+    __asm__ volatile("mov %%rsp, %0" : "=r"(rsp));
+    uint64_t stack_phys = vmm_virt_to_phys(vmm_get_kernel_pml4(), rsp);
+
+    uint64_t bootloader = 0, acpi = 0;
+    for (uint64_t i = 0; i < memmap_copy.entry_count; i++) {
+        struct limine_memmap_entry* entry = &memmap_entries[i];
+
+        if (entry->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE &&
+            entry->type != LIMINE_MEMMAP_ACPI_RECLAIMABLE) {
+            continue;
+        }
+        if (stack_phys >= entry->base && stack_phys < entry->base + entry->length) {
+            continue;
+        }
+
+        uint64_t bytes = pmm_reclaim_range(entry->base, entry->length);
+        if (entry->type == LIMINE_MEMMAP_ACPI_RECLAIMABLE) {
+            acpi += bytes;
+        } else {
+            bootloader += bytes;
+        }
+        entry->type = LIMINE_MEMMAP_USABLE;
+    }
+
+    printk("[KERNEL] Reclaimed %llu KB of bootloader and %llu KB of ACPI memory\n",
+           bootloader / 1024, acpi / 1024);
+}
+
 static void hcf(void) {
     __asm__ ("cli");
     for (;;) {
@@ -93,11 +170,21 @@ void _start(void) {
         hcf();
     }
 
+    if (kernel_address_request.response != NULL) {
+        kernel_phys_base = kernel_address_request.response->physical_base;
+    }
+
     if (memmap_request.response != NULL) {
-        memmap_response = (struct limine_memmap_response*)memmap_request.response;
+        memmap_response = copy_memory_map((struct limine_memmap_response*)memmap_request.response);
         printk("[KERNEL] Memory map retrieved.\n");
     }
 
+    // ACPI tables are reached through the HHDM, so they can be parsed before
+    // the PMM. The SRAT tells the PMM which node each frame belongs to.
+    printk("[KERNEL] Initializing ACPI...\n");
+    acpi_init();
+    numa_init();
+
         if (memmap_response != NULL) {
         printk("[KERNEL] Initializing PMM...\n");
         pmm_init(memmap_response, hhdm_offset);
@@ -109,11 +196,26 @@ void _start(void) {
     // Initialize VMM
     printk("[KERNEL] Initializing VMM...\n");
     vmm_init();
+
+    // The bootloader picked the framebuffer's memory type; fb_swap() wants
+    // write-combining
+    if (vmm_wc_enabled()) {
+        fb_set_memory_type(PTE_WC);
+        printk("[KERNEL] Framebuffer mapped write-combining\n");
+    }
     
+    // Initialize CPU structures. The heap is demand paged, so page faults
+    // have to reach vmm_handle_fault() before the first kmalloc.
+    gdt_init();
+    idt_init();
+
     // Initialize Heap
     printk("[KERNEL] Initializing Heap...\n");
     kheap_init();
 
+    // Kernel VA for stacks and MMIO windows
+    vmalloc_init();
+
     // 1. Init VFS
     vfs_init();
 
@@ -128,14 +230,6 @@ void _start(void) {
         printk("[KERNEL] Warning: No ramdisk module loaded.\n");
     }
 
-    // Initialize ACPI
-    printk("[KERNEL] Initializing ACPI...\n");
-    acpi_init();
-
-    // Initialize CPU structures
-    gdt_init();
-    idt_init();
-
     // Initialize APIC
     printk("[KERNEL] Initializing APIC...\n");
     apic_init();
@@ -147,6 +241,9 @@ void _start(void) {
     printk("[KERNEL] Initializing PCI...\n");
     pci_init();
 
+    // Boot-time structures are no longer referenced past this point
+    reclaim_boot_memory();
+
     // Initialize keyboard
     keyboard_init();
 
@@ -172,6 +269,13 @@ void _start(void) {
             __asm__ volatile ("sti"); 
             char c = keyboard_get_char();
             shell_process_char(c);
+        } else if (pmm_zero_pool_refill(ZERO_POOL_IDLE_BATCH) > 0) {
+            // Idle time goes to clearing frames for the zero pool
+            __asm__ volatile ("sti");
+        } else if (kheap_trim_pending()) {
+            // ...and to handing free heap pages back
+            __asm__ volatile ("sti");
+            kheap_trim(HEAP_TRIM_IDLE_BATCH);
         } else {
             __asm__ volatile ("sti; hlt"); 
         }
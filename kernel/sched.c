@@ -1,9 +1,14 @@
 #include "sched.h"
-#include "../mm/heap.h"
+#include "../mm/pmm.h"
+#include "../mm/vmalloc.h"
+#include "../mm/slab.h"
+#include "../mm/arena.h"
 #include "../lib/string.h"
 #include "../lib/printk.h"
 #include "lib/panic.h"
 
+#define THREAD_STACK_SIZE 8192
+
 static uint64_t tick_count = 0;
 
 // This struct must exactly match the registers pushed in irq_common_stub
@@ -24,10 +29,17 @@ typedef struct thread {
 
 static thread_t* current_thread = NULL;
 static int next_thread_id = 0;
+static kmem_cache_t* thread_cache = NULL;
 
 void sched_init(void) {
-    // Create the "Main" thread (the code currently running)
-    thread_t* main_thread = (thread_t*)kmalloc(sizeof(thread_t));
+    thread_cache = kmem_cache_create("thread", sizeof(thread_t), 0, NULL);
+
+    // Create the "Main" thread (the code currently running). It never
+    // exits, so it lives in the boot arena.
+    thread_t* main_thread = (thread_t*)arena_alloc(&boot_arena, sizeof(thread_t), 0);
+    if (!main_thread) {
+        panic("sched: out of memory for the main thread");
+    }
     main_thread->id = next_thread_id++;
     main_thread->stack_base = NULL; // Main thread already has a stack from Limine
     main_thread->next = main_thread; // Circular list
@@ -47,14 +59,23 @@ void thread_create(void (*entry_point)(void)) {
     uint64_t rflags;
     __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags));
 
-    thread_t* new_thread = (thread_t*)kmalloc(sizeof(thread_t));
+    thread_t* new_thread = (thread_t*)kmem_cache_alloc(thread_cache);
+    if (!new_thread) {
+        panic("sched: out of memory for thread");
+    }
     new_thread->id = next_thread_id++;
     
-    // Allocate 8KB for the thread's stack
-    new_thread->stack_base = kmalloc(8192);
+    // Allocate 8KB for the thread's stack from vmalloc: the frames come from
+    // the creating CPU's NUMA node, and the unmapped guard page below turns
+    // an overflow into a fault (a double fault, taken on its own stack)
+    // that names the thread instead of silent corruption
+    new_thread->stack_base = vmalloc_owned(THREAD_STACK_SIZE, PMM_OWNER_STACK);
+    if (!new_thread->stack_base) {
+        panic("sched: out of memory for thread stack");
+    }
     
     // Top of the stack
-    uint64_t* stack_top = (uint64_t*)((uint64_t)new_thread->stack_base + 8192);
+    uint64_t* stack_top = (uint64_t*)((uint64_t)new_thread->stack_base + THREAD_STACK_SIZE);
     
     // Place the return address (thread_exit) at the top of the stack
     uint64_t* stack_ptr = stack_top;
@@ -97,4 +118,19 @@ uint64_t sched_tick(uint64_t current_rsp) {
     current_thread->rsp = current_rsp;
     current_thread = current_thread->next;
     return current_thread->rsp;
-}
\ No newline at end of file
+}
+
+int sched_stack_guard_owner(uint64_t addr) {
+    thread_t* thread = current_thread;
+    if (!thread) return -1;
+
+    // The guard is the page just below each vmalloc'd stack
+    do {
+        uint64_t base = (uint64_t)thread->stack_base;
+        if (base && addr >= base - PAGE_SIZE && addr < base) {
+            return thread->id;
+        }
+        thread = thread->next;
+    } while (thread != current_thread);
+    return -1;
+}
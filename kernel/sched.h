@@ -7,6 +7,9 @@ void sched_init(void);
 void thread_create(void (*entry_point)(void));
 uint64_t sched_tick(uint64_t current_rsp);
 
+// ID of the thread whose stack guard page holds 'addr', or -1
+int sched_stack_guard_owner(uint64_t addr);
+
 #define SCHED_SLICE 10  // switch every 10 timer ticks
 
 #endif
\ No newline at end of file
@@ -10,4 +10,169 @@ void bitmap_clear(uint8_t *bitmap, uint64_t index) {
 
 bool bitmap_test(uint8_t *bitmap, uint64_t index) {
     return (bitmap[index / 8] & (1 << (index % 8))) > 0;
-}
\ No newline at end of file
+}
+
+// --- Summary bitmap ---
+
+#define WORD_FULL (~0ULL)
+
+// Count trailing zeros; compiles to bsf/tzcnt
+static inline uint64_t ctz64(uint64_t value) {
+    return (uint64_t)__builtin_ctzll(value);
+}
+
+// Mask with the lowest 'n' bits set (n < 64)
+static inline uint64_t low_mask(uint64_t n) {
+    return (1ULL << n) - 1;
+}
+
+static inline uint64_t summary_words(uint64_t words) {
+    return (words + 63) / 64;
+}
+
+static inline void summary_update(hbitmap_t *bm, uint64_t w) {
+    if (bm->bits[w] == WORD_FULL) {
+        bm->summary[w / 64] |= (1ULL << (w % 64));
+    } else {
+        bm->summary[w / 64] &= ~(1ULL << (w % 64));
+    }
+}
+
+size_t hbitmap_storage_size(uint64_t size) {
+    uint64_t words = (size + 63) / 64;
+    return (words + summary_words(words)) * sizeof(uint64_t);
+}
+
+void hbitmap_init(hbitmap_t *bm, void *storage, uint64_t size, bool all_set) {
+    bm->size = size;
+    bm->words = (size + 63) / 64;
+    bm->bits = (uint64_t*)storage;
+    bm->summary = bm->bits + bm->words;
+
+    for (uint64_t w = 0; w < bm->words; w++) {
+        bm->bits[w] = all_set ? WORD_FULL : 0;
+    }
+
+    // Items past the end are permanently used so searches never return them
+    if (size % 64) {
+        bm->bits[bm->words - 1] |= ~low_mask(size % 64);
+    }
+
+    uint64_t sw = summary_words(bm->words);
+    for (uint64_t s = 0; s < sw; s++) {
+        bm->summary[s] = 0;
+    }
+    if (bm->words % 64) {
+        bm->summary[sw - 1] = ~low_mask(bm->words % 64);
+    }
+    for (uint64_t w = 0; w < bm->words; w++) {
+        summary_update(bm, w);
+    }
+}
+
+void hbitmap_set(hbitmap_t *bm, uint64_t index) {
+    uint64_t w = index / 64;
+    bm->bits[w] |= (1ULL << (index % 64));
+    if (bm->bits[w] == WORD_FULL) {
+        bm->summary[w / 64] |= (1ULL << (w % 64));
+    }
+}
+
+void hbitmap_clear(hbitmap_t *bm, uint64_t index) {
+    uint64_t w = index / 64;
+    bm->bits[w] &= ~(1ULL << (index % 64));
+    bm->summary[w / 64] &= ~(1ULL << (w % 64));
+}
+
+bool hbitmap_test(const hbitmap_t *bm, uint64_t index) {
+    return (bm->bits[index / 64] >> (index % 64)) & 1;
+}
+
+void hbitmap_set_range(hbitmap_t *bm, uint64_t index, uint64_t count) {
+    uint64_t end = index + count;
+
+    while (index < end) {
+        uint64_t w = index / 64;
+        uint64_t bit = index % 64;
+        uint64_t n = 64 - bit;
+        if (n > end - index) n = end - index;
+
+        bm->bits[w] |= (n == 64) ? WORD_FULL : (low_mask(n) << bit);
+        summary_update(bm, w);
+        index += n;
+    }
+}
+
+void hbitmap_clear_range(hbitmap_t *bm, uint64_t index, uint64_t count) {
+    uint64_t end = index + count;
+
+    while (index < end) {
+        uint64_t w = index / 64;
+        uint64_t bit = index % 64;
+        uint64_t n = 64 - bit;
+        if (n > end - index) n = end - index;
+
+        bm->bits[w] &= (n == 64) ? 0 : ~(low_mask(n) << bit);
+        bm->summary[w / 64] &= ~(1ULL << (w % 64));
+        index += n;
+    }
+}
+
+uint64_t hbitmap_find_first_zero(const hbitmap_t *bm, uint64_t start) {
+    if (start >= bm->size) return HBITMAP_NOT_FOUND;
+
+    // Rest of the starting word, with the bits below 'start' treated as used
+    uint64_t w = start / 64;
+    uint64_t word = bm->bits[w] | low_mask(start % 64);
+    if (word != WORD_FULL) {
+        return w * 64 + ctz64(~word);
+    }
+
+    // Then let the summary skip over full words, 64 at a time
+    w++;
+    while (w < bm->words) {
+        uint64_t s = w / 64;
+        uint64_t sum = bm->summary[s] | low_mask(w % 64);
+        if (sum == WORD_FULL) {
+            w = (s + 1) * 64;
+            continue;
+        }
+        w = s * 64 + ctz64(~sum);
+        if (w >= bm->words) break;
+        return w * 64 + ctz64(~bm->bits[w]);
+    }
+    return HBITMAP_NOT_FOUND;
+}
+
+uint64_t hbitmap_find_next_set(const hbitmap_t *bm, uint64_t start) {
+    if (start >= bm->size) return bm->size;
+
+    uint64_t w = start / 64;
+    uint64_t word = bm->bits[w] & ~low_mask(start % 64);
+
+    for (;;) {
+        if (word) {
+            uint64_t index = w * 64 + ctz64(word);
+            return (index < bm->size) ? index : bm->size;
+        }
+        if (++w >= bm->words) return bm->size;
+        word = bm->bits[w];
+    }
+}
+
+uint64_t hbitmap_find_next_zero_range(const hbitmap_t *bm, uint64_t start, uint64_t count) {
+    if (count == 0) return start;
+
+    for (;;) {
+        uint64_t first = hbitmap_find_first_zero(bm, start);
+        if (first == HBITMAP_NOT_FOUND || first + count > bm->size) {
+            return HBITMAP_NOT_FOUND;
+        }
+
+        uint64_t end = hbitmap_find_next_set(bm, first);
+        if (end - first >= count) {
+            return first;
+        }
+        start = end;
+    }
+}
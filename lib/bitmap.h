@@ -9,4 +9,41 @@ void bitmap_set(uint8_t *bitmap, uint64_t index);
 void bitmap_clear(uint8_t *bitmap, uint64_t index);
 bool bitmap_test(uint8_t *bitmap, uint64_t index);
 
-#endif
\ No newline at end of file
+// Two-level summary bitmap built on 64-bit words. A set bit means "used".
+// Bit w of 'summary' is set when bits[w] is completely full, so searches for
+// a zero skip 64 full words (4096 items) with a single compare.
+typedef struct {
+    uint64_t *bits;       // One bit per item
+    uint64_t *summary;    // One bit per word of 'bits'
+    uint64_t size;        // Number of items
+    uint64_t words;       // Number of words in 'bits'
+} hbitmap_t;
+
+#define HBITMAP_NOT_FOUND ((uint64_t)-1)
+
+// Bytes of storage needed for a bitmap of 'size' items
+size_t hbitmap_storage_size(uint64_t size);
+
+// Set up a bitmap on caller-provided storage with every item used (all_set)
+// or free. Bits past 'size' always read as used.
+void hbitmap_init(hbitmap_t *bm, void *storage, uint64_t size, bool all_set);
+
+void hbitmap_set(hbitmap_t *bm, uint64_t index);
+void hbitmap_clear(hbitmap_t *bm, uint64_t index);
+bool hbitmap_test(const hbitmap_t *bm, uint64_t index);
+
+// Set/clear 'count' items starting at 'index', a word at a time
+void hbitmap_set_range(hbitmap_t *bm, uint64_t index, uint64_t count);
+void hbitmap_clear_range(hbitmap_t *bm, uint64_t index, uint64_t count);
+
+// First clear item at or after 'start', or HBITMAP_NOT_FOUND
+uint64_t hbitmap_find_first_zero(const hbitmap_t *bm, uint64_t start);
+
+// First set item at or after 'start', or bm->size if there is none
+uint64_t hbitmap_find_next_set(const hbitmap_t *bm, uint64_t start);
+
+// Start of the first run of 'count' clear items at or after 'start',
+// or HBITMAP_NOT_FOUND
+uint64_t hbitmap_find_next_zero_range(const hbitmap_t *bm, uint64_t start, uint64_t count);
+
+#endif
@@ -0,0 +1,122 @@
+#include "arena.h"
+#include "pmm.h"
+#include "../lib/string.h"
+#include "../lib/panic.h"
+
+#define ARENA_ALIGN     8
+
+extern uint64_t hhdm_offset;
+
+// Header at the start of every chunk
+struct arena_chunk {
+    arena_chunk_t* next;
+    size_t pages;
+};
+
+arena_t boot_arena = ARENA_INIT("boot", ARENA_CHUNK_PAGES);
+
+static inline uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static inline uint8_t* chunk_data(arena_chunk_t* chunk) {
+    return (uint8_t*)chunk + align_up(sizeof(arena_chunk_t), ARENA_ALIGN);
+}
+
+void arena_init(arena_t* arena, const char* name, size_t chunk_pages) {
+    memset(arena, 0, sizeof(*arena));
+    arena->name = name;
+    arena->chunk_pages = chunk_pages ? chunk_pages : ARENA_CHUNK_PAGES;
+    spinlock_init(&arena->lock);
+}
+
+// New chunk with room for the request, which is carved from it. Lock held.
+static void* arena_grow(arena_t* arena, size_t size, size_t align) {
+    uint64_t offset = align_up(align_up(sizeof(arena_chunk_t), ARENA_ALIGN), align);
+    uint64_t pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages < arena->chunk_pages) pages = arena->chunk_pages;
+
+    void* phys = (pages > 1) ? pmm_alloc_pages(pages) : pmm_alloc_page();
+    if (!phys) return NULL;
+    pmm_set_owner(phys, pages, PMM_OWNER_ARENA);
+
+    arena_chunk_t* chunk = (arena_chunk_t*)((uint64_t)phys + hhdm_offset);
+    chunk->pages = pages;
+    uint8_t* ptr = (uint8_t*)chunk + offset;
+    uint8_t* end = (uint8_t*)chunk + pages * PAGE_SIZE;
+
+    // Keep bumping in whichever chunk has more room left, so one big
+    // request does not strand the rest of the current chunk
+    if (!arena->chunks || (uint64_t)(end - ptr) - size > (uint64_t)(arena->end - arena->next)) {
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->next = ptr + size;
+        arena->end = end;
+    } else {
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+    }
+
+    arena->pages += pages;
+    return ptr;
+}
+
+void* arena_alloc(arena_t* arena, size_t size, size_t align) {
+    if (size == 0) return NULL;
+    if (align == 0) align = ARENA_ALIGN;
+    if ((align & (align - 1)) || align > PAGE_SIZE) {
+        panic("arena: Bad alignment");
+    }
+
+    spinlock_acquire(&arena->lock);
+
+    void* ptr;
+    uint64_t start = align_up((uint64_t)arena->next, align);
+    if (arena->chunks && start + size <= (uint64_t)arena->end) {
+        arena->used_bytes += start + size - (uint64_t)arena->next;
+        arena->next = (uint8_t*)(start + size);
+        ptr = (void*)start;
+    } else {
+        ptr = arena_grow(arena, size, align);
+        if (ptr) arena->used_bytes += size;
+    }
+    if (ptr) arena->allocs++;
+
+    spinlock_release(&arena->lock);
+    return ptr;
+}
+
+char* arena_strndup(arena_t* arena, const char* s, size_t max) {
+    size_t len = 0;
+    while (len < max && s[len]) len++;
+
+    char* copy = (char*)arena_alloc(arena, len + 1, 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+size_t arena_reset(arena_t* arena) {
+    size_t frames = 0;
+
+    spinlock_acquire(&arena->lock);
+    arena_chunk_t* keep = arena->chunks;
+    if (keep) {
+        arena_chunk_t* chunk = keep->next;
+        while (chunk) {
+            arena_chunk_t* next = chunk->next;
+            frames += chunk->pages;
+            pmm_free_pages((void*)((uint64_t)chunk - hhdm_offset), chunk->pages);
+            chunk = next;
+        }
+        keep->next = NULL;
+        arena->next = chunk_data(keep);
+        arena->end = (uint8_t*)keep + keep->pages * PAGE_SIZE;
+    }
+    arena->pages -= frames;
+    arena->allocs = 0;
+    arena->used_bytes = 0;
+    spinlock_release(&arena->lock);
+    return frames;
+}
@@ -0,0 +1,53 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../lib/spinlock.h"
+
+// Bump allocators for data that is never freed, or freed all at once.
+// An arena hands out memory from the current chunk (a run of frames reached
+// through the HHDM) by moving a pointer; objects carry no header and are
+// packed back to back. There is no per-object free: arena_reset() drops
+// everything at once. Only the PMM has to be up, so an arena works before
+// the heap does.
+
+#define ARENA_CHUNK_PAGES   4   // Default chunk size
+
+typedef struct arena_chunk arena_chunk_t;
+
+typedef struct arena {
+    const char* name;
+    size_t chunk_pages;         // Size of a new chunk (bigger requests get their own)
+    arena_chunk_t* chunks;      // The chunk being carved comes first
+    uint8_t* next;              // Bump pointer in the first chunk
+    uint8_t* end;
+
+    // Statistics
+    uint64_t allocs;
+    uint64_t used_bytes;        // Handed out, including alignment padding
+    uint64_t pages;             // Frames held
+
+    spinlock_t lock;
+} arena_t;
+
+#define ARENA_INIT(arena_name, pages) { .name = (arena_name), .chunk_pages = (pages) }
+
+// Objects that live as long as the kernel: initrd nodes, ACPI table
+// copies, the boot thread
+extern arena_t boot_arena;
+
+void arena_init(arena_t* arena, const char* name, size_t chunk_pages);
+
+// 'size' bytes aligned to 'align' (a power of two up to PAGE_SIZE, 0 = 8
+// bytes). Not zeroed. Returns NULL when out of memory.
+void* arena_alloc(arena_t* arena, size_t size, size_t align);
+
+// Copy of 's', at most 'max' characters plus the terminator
+char* arena_strndup(arena_t* arena, const char* s, size_t max);
+
+// Drop every object. The first chunk is kept for reuse, the rest go back
+// to the PMM. Returns the frames freed.
+size_t arena_reset(arena_t* arena);
+
+#endif
@@ -1,32 +1,142 @@
 #include "heap.h"
 #include "pmm.h"
 #include "vmm.h"
+#include "vmalloc.h"
 #include "../lib/string.h"
 #include "../lib/printk.h"
 #include "../lib/panic.h"
 #include "../lib/spinlock.h"
+#include "../arch/cpu.h"
+#include "../drivers/timer.h"
 
-// Header for each heap block
+// Two-level segregated fit (TLSF). Free blocks are binned by size: the first
+// level splits sizes by power of two, the second splits each power of two
+// into SL_COUNT equal ranges. A bitmap per level records which bins are
+// non-empty, so finding a fitting block, freeing and coalescing are all a
+// handful of bit scans and list operations, however large the heap grows.
+
+// Header for each heap block. Blocks tile the heap back to back: the next
+// block starts right after this one's data, 'prev_phys' points at the one
+// before it so both neighbours can be merged without a walk.
 typedef struct block_header {
-    size_t size;            // Size of the data part (excluding header)
-    uint8_t is_free;        // 1 if free, 0 if used
-    struct block_header* next;
-    struct block_header* prev;
-    uint64_t magic;         // Magic number to detect corruption
+    size_t size;                    // Size of the data part (excluding header)
+    struct block_header* prev_phys; // Block just below, NULL for the first
+    uint64_t magic;                 // Magic number to detect corruption
+    uint8_t is_free;                // 1 if free, 0 if used
+    uint8_t is_zeroed;              // 1 if the data part is all zeroes (a free
+                                    // block's list links excepted)
+    uint8_t cached;                 // 1 while freed into a per-CPU cache
+    uint8_t size_class;             // Per-CPU cache class + 1, 0 if uncached
+    uint8_t cpu;                    // CPU whose cache the block belongs to
+    uint8_t trimmed;                // TRIM_*: how far its inner pages went
+                                    // back to the PMM
+    uint16_t site;                  // Profiled allocation site + 1, 0 if none
 } block_header_t;
 
+// A free block keeps its bin links at the start of its data part
+typedef struct free_links {
+    block_header_t* next;
+    block_header_t* prev;
+} free_links_t;
+
+// A free block trimmed partway keeps where to resume just past its links
+#define TRIM_NONE       0
+#define TRIM_DONE       1
+#define TRIM_PARTIAL    2
+
 #define HEAP_MAGIC 0xC0FFEE1234567890
 #define HEADER_SIZE sizeof(block_header_t)
 
+#define ALIGN_LOG2      4
+#define ALIGN_SIZE      (1 << ALIGN_LOG2)
+#define MIN_BLOCK       sizeof(free_links_t)    // Room for the bin links
+#define SL_LOG2         4
+#define SL_COUNT        (1 << SL_LOG2)          // Bins per power of two
+#define FL_SHIFT        (SL_LOG2 + ALIGN_LOG2)
+#define FL_MAX          37                      // Blocks below 128GB
+#define FL_COUNT        (FL_MAX - FL_SHIFT + 1)
+#define SMALL_BLOCK     (1 << FL_SHIFT)         // Below this, bins are ALIGN_SIZE apart
+#define MAX_REQUEST     (1ULL << (FL_MAX - 1))
+
+#define HEAP_CLASSES    12
+
+extern uint64_t hhdm_offset;
+
 // Global Heap State
 static block_header_t* heap_start = NULL;
-static block_header_t* heap_tail = NULL; // Optimization: Track the end
+static block_header_t* heap_tail = NULL;
 static uint64_t heap_current_end = 0;
+static const vmm_lazy_region_t* heap_region = NULL;
 static spinlock_t heap_lock;
 
+// Set when a free block of KHEAP_TRIM_THRESHOLD or more appears; the idle
+// loop's kheap_trim() then gives its whole pages back, a batch at a time
+static int trim_pending = 0;
+static int tail_trimming = 0;       // Heap end partly pulled back
+static uint64_t trim_returned = 0;
+static uint64_t trim_runs = 0;
+
+// krealloc outcomes
+static uint64_t realloc_grown = 0;
+static uint64_t realloc_shrunk = 0;
+static uint64_t realloc_moved = 0;
+static uint64_t copy_avoided = 0;   // Bytes kept in place rather than copied
+static uint64_t copy_done = 0;
+
+// Allocation-site profile. Sites are found by hashing the caller's
+// address; a block remembers its site so kfree can charge it back.
+static int profiling = 0;
+static kheap_site_t sites[KHEAP_PROFILE_SITES];
+static uint64_t untracked = 0;
+static spinlock_t profile_lock;
+
+// Attribute a new allocation to the code that asked for it
+#define PROFILE_ALLOC(ptr, caller) \
+    do { \
+        if (__builtin_expect(profiling, 0) && (ptr)) profile_alloc((ptr), (caller)); \
+    } while (0)
+
+// Large allocations outstanding (see large_alloc())
+static uint64_t large_count = 0;
+static uint64_t large_bytes = 0;
+static uint64_t large_total = 0;
+
+// kmalloc_pages() runs outstanding
+static uint64_t page_runs = 0;
+static uint64_t page_frames = 0;
+
+static uint32_t fl_bitmap;
+static uint32_t sl_bitmap[FL_COUNT];
+static block_header_t* bins[FL_COUNT][SL_COUNT];
+
+// Per-CPU caches ("magazines") of small blocks in front of the bins. A block
+// in a magazine is still allocated as far as the bins are concerned, so the
+// common kmalloc/kfree pair is a pop or push on the executing CPU's own
+// stack with interrupts off, and takes no lock. A block freed on another CPU
+// goes onto its owner's remote-free queue, a lock-free list, and rejoins a
+// magazine when the owner next runs dry.
+static const uint32_t class_sizes[HEAP_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024
+};
+static uint8_t size_to_class[KHEAP_CACHE_MAX / ALIGN_SIZE + 1];   // By 16-byte units
+
+typedef struct {
+    block_header_t* blocks[KHEAP_MAG_DEPTH];
+    uint32_t count;
+} magazine_t;
+
+typedef struct {
+    magazine_t mags[HEAP_CLASSES];
+    kheap_cpu_stats_t stats;
+    // Pushed to by other CPUs: kept off the magazines' cache lines
+    block_header_t* remote __attribute__((aligned(64)));
+} __attribute__((aligned(64))) heap_cpu_t;
+
+static heap_cpu_t heap_cpus[MAX_CPUS];
+
 // Helper: Align size to 16 bytes
 static inline size_t align(size_t n) {
-    return (n + 15) & ~15;
+    return (n + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
 }
 
 // Helper: Min function
@@ -34,54 +144,194 @@ static inline size_t min(size_t a, size_t b) {
     return (a < b) ? a : b;
 }
 
-// Core Logic: Find a free block, split it if necessary, and mark as used.
-// Returns NULL if no block is found.
-static block_header_t* find_split_and_alloc(size_t aligned_size) {
-    block_header_t* current = heap_start;
+// Index of the highest set bit
+static inline int fls64(uint64_t value) {
+    return 63 - __builtin_clzll(value);
+}
 
-    while (current != NULL) {
-        if (current->magic != HEAP_MAGIC) {
-            spinlock_release(&heap_lock);
-            panic("Heap corruption detected (Magic Number Mismatch)!");
-        }
+static inline uint8_t* block_data(block_header_t* block) {
+    return (uint8_t*)block + HEADER_SIZE;
+}
 
-        if (current->is_free && current->size >= aligned_size) {
-            // Found a fit!
-            
-            // Split logic: Do we have enough space for a new header + 16 bytes?
-            if (current->size >= aligned_size + HEADER_SIZE + 16) {
-                block_header_t* new_block = (block_header_t*)((uint64_t)current + HEADER_SIZE + aligned_size);
-                
-                new_block->size = current->size - aligned_size - HEADER_SIZE;
-                new_block->is_free = 1;
-                new_block->magic = HEAP_MAGIC;
-                new_block->next = current->next;
-                new_block->prev = current;
-                
-                if (current->next) {
-                    current->next->prev = new_block;
-                } else {
-                    // If current was tail, new_block is now tail
-                    heap_tail = new_block;
-                }
-                
-                current->next = new_block;
-                current->size = aligned_size;
-            }
-            
-            current->is_free = 0;
-            return current;
+static inline free_links_t* block_links(block_header_t* block) {
+    return (free_links_t*)block_data(block);
+}
+
+static inline block_header_t* block_from_ptr(void* ptr) {
+    return (block_header_t*)((uint64_t)ptr - HEADER_SIZE);
+}
+
+// Block right after this one, or NULL for the tail
+static inline block_header_t* next_phys(block_header_t* block) {
+    return (block == heap_tail) ? NULL : (block_header_t*)(block_data(block) + block->size);
+}
+
+static void check_block(block_header_t* block, const char* msg) {
+    if (block->magic != HEAP_MAGIC) {
+        spinlock_release(&heap_lock);
+        panic(msg);
+    }
+}
+
+// Bin holding blocks of exactly 'size' bytes
+static void mapping_insert(size_t size, int* fl, int* sl) {
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK / SL_COUNT);
+    } else {
+        int bit = fls64(size);
+        *sl = (size >> (bit - SL_LOG2)) ^ SL_COUNT;
+        *fl = bit - (FL_SHIFT - 1);
+    }
+}
+
+// First bin whose every block is at least 'size' bytes
+static void mapping_search(size_t size, int* fl, int* sl) {
+    if (size >= SMALL_BLOCK) {
+        size += (1ULL << (fls64(size) - SL_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+static void bin_insert(block_header_t* block) {
+    int fl, sl;
+    mapping_insert(block->size, &fl, &sl);
+
+    free_links_t* links = block_links(block);
+    links->prev = NULL;
+    links->next = bins[fl][sl];
+    if (links->next) block_links(links->next)->prev = block;
+    bins[fl][sl] = block;
+
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+    block->is_free = 1;
+}
+
+static void bin_remove(block_header_t* block) {
+    int fl, sl;
+    mapping_insert(block->size, &fl, &sl);
+
+    free_links_t* links = block_links(block);
+    if (links->prev) block_links(links->prev)->next = links->next;
+    else bins[fl][sl] = links->next;
+    if (links->next) block_links(links->next)->prev = links->prev;
+
+    if (!bins[fl][sl]) {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (!sl_bitmap[fl]) fl_bitmap &= ~(1U << fl);
+    }
+    block->is_free = 0;
+}
+
+// Take a free block of at least 'size' bytes off its bin, or NULL
+static block_header_t* bin_take(size_t size) {
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+    if (fl >= FL_COUNT) return NULL;
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        uint32_t fl_map = fl_bitmap & (~0U << (fl + 1));
+        if (!fl_map) return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    block_header_t* block = bins[fl][sl];
+    check_block(block, "Heap corruption detected (Magic Number Mismatch)!");
+    bin_remove(block);
+    return block;
+}
+
+// Fold 'right' (free, off its bin) into its left neighbour 'left'
+static void absorb(block_header_t* left, block_header_t* right) {
+    left->size += HEADER_SIZE + right->size;
+    left->trimmed = TRIM_NONE;
+    if (right == heap_tail) {
+        heap_tail = left;
+    } else {
+        next_phys(left)->prev_phys = left;
+    }
+
+    // Still all zeroes if both halves were, once the absorbed header and
+    // links are wiped
+    if (left->is_zeroed && right->is_zeroed) {
+        memset(right, 0, HEADER_SIZE + sizeof(free_links_t));
+    } else {
+        left->is_zeroed = 0;
+    }
+}
+
+// Merge a block that is on no bin with free neighbours, then bin it.
+// Returns the merged block.
+static block_header_t* release_block(block_header_t* block) {
+    block_header_t* next = next_phys(block);
+    if (next) {
+        check_block(next, "Heap corruption detected during kfree!");
+        if (next->is_free) {
+            bin_remove(next);
+            absorb(block, next);
         }
-        current = current->next;
     }
-    return NULL;
+
+    block_header_t* prev = block->prev_phys;
+    if (prev) {
+        check_block(prev, "Heap corruption detected during kfree!");
+    }
+    if (prev && prev->is_free) {
+        bin_remove(prev);
+        absorb(prev, block);
+        block = prev;
+    }
+
+    bin_insert(block);
+    return block;
+}
+
+// Cut a block down to 'size' bytes. Returns the remainder as a new block on
+// no bin, or NULL if it would be too small to stand alone.
+static block_header_t* split_off(block_header_t* block, size_t size) {
+    if (block->size < size + HEADER_SIZE + MIN_BLOCK) return NULL;
+
+    block_header_t* rest = (block_header_t*)(block_data(block) + size);
+    rest->size = block->size - size - HEADER_SIZE;
+    rest->prev_phys = block;
+    rest->magic = HEAP_MAGIC;
+    rest->is_zeroed = block->is_zeroed;
+    rest->cached = 0;
+    rest->size_class = 0;
+    rest->trimmed = TRIM_NONE;
+    rest->site = 0;
+
+    if (block == heap_tail) {
+        heap_tail = rest;
+    } else {
+        next_phys(rest)->prev_phys = rest;
+    }
+    block->size = size;
+    return rest;
+}
+
+// Trim a block taken for 'size' bytes and hand the rest back
+static void split_block(block_header_t* block, size_t size) {
+    // The remainder cannot touch a free neighbour: the block was free, so
+    // its neighbours were not
+    block_header_t* rest = split_off(block, size);
+    if (rest) bin_insert(rest);
 }
 
-// Internal function: Expand the heap
+// Internal function: Expand the heap. Returns 0 if it cannot grow.
 // NOTE: Must be called with lock held!
-static void heap_expand(size_t size_needed) {
+static int heap_expand(size_t size_needed) {
+    // Leave room for mapping_search() rounding up, so the new block lands
+    // in a bin bin_take() will look at
     size_t total_needed = size_needed + HEADER_SIZE;
-    
+    if (size_needed >= SMALL_BLOCK) {
+        total_needed += (1ULL << (fls64(size_needed) - SL_LOG2));
+    }
+
     // Enforce minimum expansion size
     if (total_needed < KHEAP_MIN_SIZE) {
         total_needed = KHEAP_MIN_SIZE;
@@ -90,144 +340,498 @@ static void heap_expand(size_t size_needed) {
     size_t pages_needed = (total_needed + PAGE_SIZE - 1) / PAGE_SIZE;
     uint64_t old_end = heap_current_end;
 
-    for (size_t i = 0; i < pages_needed; i++) {
-        void* phys = pmm_alloc_page();
-        if (!phys) {
-            spinlock_release(&heap_lock);
-            panic("Heap: OOM during expansion");
-        }
-        
-        vmm_map(vmm_get_kernel_pml4(), heap_current_end, (uint64_t)phys, PTE_PRESENT | PTE_RW);
-        heap_current_end += PAGE_SIZE;
+    // The heap region is demand paged: growing it only moves the end.
+    // Frames arrive zeroed on first write, reads until then see zeroes.
+    // Every heap page not backed yet may still be written, so the heap only
+    // grows while free memory covers those pages and the new ones; otherwise
+    // kmalloc fails now instead of a page fault failing later.
+    uint64_t heap_pages = (heap_current_end - KHEAP_START) / PAGE_SIZE;
+    uint64_t unbacked = heap_pages - heap_region->resident;
+    if (heap_region->resident > heap_pages) unbacked = 0;
+    if (pages_needed * PAGE_SIZE > KHEAP_START + KHEAP_MAX_SIZE - heap_current_end ||
+        unbacked + pages_needed > pmm_get_free_memory() / PAGE_SIZE) {
+        return 0;
     }
+    heap_current_end += pages_needed * PAGE_SIZE;
 
     // Create a new block in the newly mapped area
     block_header_t* new_block = (block_header_t*)old_end;
     new_block->size = (pages_needed * PAGE_SIZE) - HEADER_SIZE;
-    new_block->is_free = 1;
+    new_block->prev_phys = heap_tail;
     new_block->magic = HEAP_MAGIC;
-    new_block->next = NULL;
-    new_block->prev = heap_tail;
-    
-    // Link it
-    if (heap_tail) {
-        heap_tail->next = new_block;
-    } else {
-        // Should not happen if init was called, but for safety
-        heap_start = new_block;
-    }
+    new_block->is_free = 0;
+    new_block->is_zeroed = 1;
+    new_block->cached = 0;
+    new_block->size_class = 0;
+    new_block->trimmed = TRIM_NONE;
+    new_block->site = 0;
     heap_tail = new_block;
 
     // Coalesce Left immediately (Merge with previous tail if it was free)
-    if (new_block->prev && new_block->prev->is_free) {
-        block_header_t* prev = new_block->prev;
-        prev->size += HEADER_SIZE + new_block->size;
-        prev->next = new_block->next; // which is NULL
-        
-        // Update tail pointer to the previous block (since it absorbed the new one)
-        heap_tail = prev;
-        
-        // new_block is now invalid/consumed
-    }
+    release_block(new_block);
+    return 1;
 }
 
 void kheap_init(void) {
     spinlock_init(&heap_lock);
-    heap_current_end = KHEAP_START;
-    
-    // Allocate initial pages
-    size_t pages = KHEAP_INITIAL_SIZE / PAGE_SIZE;
-    for (size_t i = 0; i < pages; i++) {
-        void* phys = pmm_alloc_page();
-        if (!phys) panic("Heap: Failed to allocate initial pages");
-        
-        vmm_map(vmm_get_kernel_pml4(), heap_current_end, (uint64_t)phys, PTE_PRESENT | PTE_RW);
-        heap_current_end += PAGE_SIZE;
-    }
+    spinlock_init(&profile_lock);
+    heap_region = vmm_reserve_lazy("heap", KHEAP_START, KHEAP_MAX_SIZE, PMM_OWNER_HEAP);
+    heap_current_end = KHEAP_START + KHEAP_INITIAL_SIZE;
 
     // Initialize first block
     heap_start = (block_header_t*)KHEAP_START;
     heap_start->size = KHEAP_INITIAL_SIZE - HEADER_SIZE;
-    heap_start->is_free = 1;
-    heap_start->next = NULL;
-    heap_start->prev = NULL;
+    heap_start->prev_phys = NULL;
     heap_start->magic = HEAP_MAGIC;
-    
+    heap_start->is_zeroed = 1;
     heap_tail = heap_start;
+    bin_insert(heap_start);
+
+    int class = 0;
+    for (uint32_t units = 0; units <= KHEAP_CACHE_MAX / ALIGN_SIZE; units++) {
+        while (class_sizes[class] < units * ALIGN_SIZE) class++;
+        size_to_class[units] = class;
+    }
 
-    printk("[HEAP] Initialized. Lock ready.\n");
+    printk("[HEAP] Initialized (TLSF, %d x %d bins). Lock ready.\n", FL_COUNT, SL_COUNT);
 }
 
-void* kmalloc(size_t size) {
-    if (size == 0) return NULL;
-    
+// Carve a block of 'aligned_size' bytes out of the bins. Lock held.
+static block_header_t* heap_take(size_t aligned_size) {
+    // 1. Try to find a block, 2. expand the heap if there is none
+    block_header_t* block = bin_take(aligned_size);
+    if (!block && heap_expand(aligned_size)) {
+        block = bin_take(aligned_size);
+    }
+    if (!block) return NULL;
+
+    split_block(block, aligned_size);
+    block->cached = 0;
+    block->size_class = 0;
+    block->trimmed = TRIM_NONE;     // Its pages will be touched again
+
+    // The bin links were the only non-zero bytes
+    if (block->is_zeroed) {
+        memset(block_data(block), 0, sizeof(free_links_t));
+    }
+    return block;
+}
+
+// Give a block back to the bins. Lock held.
+static void heap_put(block_header_t* block) {
+    block->cached = 0;
+    block->is_zeroed = 0;
+    block = release_block(block);
+    if (block->size >= KHEAP_TRIM_THRESHOLD) {
+        trim_pending = 1;
+    }
+}
+
+// Carve a block whose data starts on an 'alignment' boundary. Lock held.
+static block_header_t* heap_take_aligned(size_t size, size_t alignment) {
+    // A gap in front must be able to stand as a free block
+    size_t gap_min = HEADER_SIZE + MIN_BLOCK;
+    block_header_t* block = heap_take(size + alignment + gap_min);
+    if (!block) return NULL;
+
+    uint64_t data = (uint64_t)block_data(block);
+    uint64_t target = (data + alignment - 1) & ~(uint64_t)(alignment - 1);
+    if (target != data && target - data < gap_min) {
+        target = (data + gap_min + alignment - 1) & ~(uint64_t)(alignment - 1);
+    }
+
+    if (target != data) {
+        // The block starts over at 'target'; what is in front goes back
+        block_header_t* front = block;
+        block = (block_header_t*)(target - HEADER_SIZE);
+        block->size = front->size - (target - data);
+        block->prev_phys = front;
+        block->magic = HEAP_MAGIC;
+        block->is_free = 0;
+        block->is_zeroed = front->is_zeroed;
+        block->cached = 0;
+        block->size_class = 0;
+        block->trimmed = TRIM_NONE;
+        block->site = 0;
+        if (front == heap_tail) {
+            heap_tail = block;
+        } else {
+            next_phys(block)->prev_phys = block;
+        }
+        front->size = target - data - HEADER_SIZE;
+        heap_put(front);
+    }
+
+    // heap_take() may have left a free block on the right: merge with it
+    block_header_t* rest = split_off(block, size);
+    if (rest) heap_put(rest);
+    return block;
+}
+
+// Top a magazine up from the bins. Interrupts off.
+static void mag_refill(heap_cpu_t* pc, magazine_t* mag, int class, uint32_t cpu) {
+    spinlock_acquire(&heap_lock);
+    while (mag->count < KHEAP_MAG_BATCH) {
+        block_header_t* block = heap_take(class_sizes[class]);
+        if (!block) break;
+        block->size_class = class + 1;
+        block->cpu = cpu;
+        block->cached = 1;
+        mag->blocks[mag->count++] = block;
+    }
+    spinlock_release(&heap_lock);
+    pc->stats.refills++;
+}
+
+// Return the oldest half of a full magazine to the bins. Interrupts off.
+static void mag_flush(heap_cpu_t* pc, magazine_t* mag) {
     spinlock_acquire(&heap_lock);
+    for (uint32_t i = 0; i < KHEAP_MAG_BATCH; i++) {
+        heap_put(mag->blocks[i]);
+    }
+    spinlock_release(&heap_lock);
 
-    size_t aligned_size = align(size);
-    
-    // 1. Try to find a block
-    block_header_t* block = find_split_and_alloc(aligned_size);
-    
-    if (block) {
+    mag->count -= KHEAP_MAG_BATCH;
+    for (uint32_t i = 0; i < mag->count; i++) {
+        mag->blocks[i] = mag->blocks[i + KHEAP_MAG_BATCH];
+    }
+    pc->stats.flushes++;
+}
+
+// A free block's remote-queue link lives in its data part
+static inline block_header_t** remote_link(block_header_t* block) {
+    return (block_header_t**)block_data(block);
+}
+
+static void remote_push(heap_cpu_t* owner, block_header_t* block) {
+    block_header_t* head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    do {
+        *remote_link(block) = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote, &head, block, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Move every block other CPUs freed for us into our magazines; what does
+// not fit goes back to the bins. Interrupts off.
+static void remote_drain(heap_cpu_t* pc) {
+    block_header_t* block = __atomic_exchange_n(&pc->remote, NULL, __ATOMIC_ACQUIRE);
+    block_header_t* overflow = NULL;
+
+    while (block) {
+        block_header_t* next = *remote_link(block);
+        magazine_t* mag = &pc->mags[block->size_class - 1];
+        if (mag->count < KHEAP_MAG_DEPTH) {
+            mag->blocks[mag->count++] = block;
+        } else {
+            *remote_link(block) = overflow;
+            overflow = block;
+        }
+        pc->stats.remote_drained++;
+        block = next;
+    }
+
+    if (overflow) {
+        spinlock_acquire(&heap_lock);
+        while (overflow) {
+            block_header_t* next = *remote_link(overflow);
+            heap_put(overflow);
+            overflow = next;
+        }
         spinlock_release(&heap_lock);
-        return (void*)((uint64_t)block + HEADER_SIZE);
-    }
-    
-    // 2. No block found, expand heap
-    heap_expand(aligned_size);
-    
-    // 3. Try again (Guaranteed to succeed unless OOM panic occurred)
-    block = find_split_and_alloc(aligned_size);
-    
+    }
+}
+
+static void* cache_alloc(int class) {
+    uint64_t rflags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    heap_cpu_t* pc = &heap_cpus[cpu];
+    magazine_t* mag = &pc->mags[class];
+
+    if (mag->count == 0) {
+        pc->stats.misses++;
+        if (__atomic_load_n(&pc->remote, __ATOMIC_RELAXED)) {
+            remote_drain(pc);
+        }
+        if (mag->count == 0) {
+            mag_refill(pc, mag, class, cpu);
+        }
+        if (mag->count == 0) {
+            cpu_irq_restore(rflags);
+            return NULL;
+        }
+    } else {
+        pc->stats.hits++;
+    }
+
+    block_header_t* block = mag->blocks[--mag->count];
+    block->cached = 0;
+    cpu_irq_restore(rflags);
+    return block_data(block);
+}
+
+static void cache_free(block_header_t* block) {
+    uint64_t rflags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    heap_cpu_t* pc = &heap_cpus[cpu];
+
+    block->cached = 1;
+    block->is_zeroed = 0;
+
+    if (block->cpu != cpu) {
+        remote_push(&heap_cpus[block->cpu], block);
+        pc->stats.remote_frees++;
+        cpu_irq_restore(rflags);
+        return;
+    }
+
+    magazine_t* mag = &pc->mags[block->size_class - 1];
+    if (mag->count == KHEAP_MAG_DEPTH) {
+        mag_flush(pc, mag);
+    }
+    mag->blocks[mag->count++] = block;
+    pc->stats.frees++;
+    cpu_irq_restore(rflags);
+}
+
+// --- Profiling ---
+
+// Slot for 'caller' (+ 1), claiming a free one; 0 if the table is full.
+// Profile lock held.
+static uint16_t site_lookup(uint64_t caller) {
+    uint32_t slot = (uint32_t)((caller * 0x9E3779B97F4A7C15ULL) >> 32) % KHEAP_PROFILE_SITES;
+    for (uint32_t i = 0; i < KHEAP_PROFILE_SITES; i++) {
+        kheap_site_t* site = &sites[slot];
+        if (site->caller == caller) return slot + 1;
+        if (site->caller == 0) {
+            site->caller = caller;
+            return slot + 1;
+        }
+        slot = (slot + 1) % KHEAP_PROFILE_SITES;
+    }
+    return 0;
+}
+
+static void profile_alloc(void* ptr, void* caller) {
+    // Large allocations have no header to keep a site in
+    if (is_vmalloc_addr(ptr)) return;
+
+    block_header_t* block = block_from_ptr(ptr);
+    uint64_t now = timer_get_uptime_ms();
+
+    spinlock_acquire(&profile_lock);
+    block->site = site_lookup((uint64_t)caller);
+    if (block->site) {
+        kheap_site_t* site = &sites[block->site - 1];
+        if (site->allocs++ == 0) {
+            site->first_ms = now;
+            site->min_size = site->max_size = block->size;
+        }
+        if (block->size < site->min_size) site->min_size = block->size;
+        if (block->size > site->max_size) site->max_size = block->size;
+        site->last_ms = now;
+        site->live_blocks++;
+        site->live_bytes += block->size;
+        site->total_bytes += block->size;
+    } else {
+        untracked++;
+    }
+    spinlock_release(&profile_lock);
+}
+
+// A profiled block was resized in place from 'old_size'
+static void profile_resize(block_header_t* block, size_t old_size) {
+    spinlock_acquire(&profile_lock);
+    kheap_site_t* site = &sites[block->site - 1];
+    site->live_bytes += block->size - old_size;
+    if (block->size > old_size) site->total_bytes += block->size - old_size;
+    spinlock_release(&profile_lock);
+}
+
+static void profile_free(block_header_t* block) {
+    spinlock_acquire(&profile_lock);
+    kheap_site_t* site = &sites[block->site - 1];
+    site->frees++;
+    site->live_blocks--;
+    site->live_bytes -= block->size;
+    block->site = 0;
+    spinlock_release(&profile_lock);
+}
+
+void kheap_profile_enable(int on) {
+    profiling = on;
+}
+
+int kheap_profile_enabled(void) {
+    return profiling;
+}
+
+uint32_t kheap_get_sites(kheap_site_t* out, uint32_t max, uint64_t* dropped) {
+    uint32_t count = 0;
+    spinlock_acquire(&profile_lock);
+    for (uint32_t i = 0; i < KHEAP_PROFILE_SITES && count < max; i++) {
+        if (sites[i].caller) out[count++] = sites[i];
+    }
+    if (dropped) *dropped = untracked;
+    spinlock_release(&profile_lock);
+    return count;
+}
+
+// --- Allocation ---
+
+// Allocations of KHEAP_LARGE_THRESHOLD and up skip the bins: each is its
+// own vmalloc area, backed by a contiguous run where the PMM has one (mapped
+// in one go, with 2MB pages where it lines up), and unmapped and freed as a
+// whole by kfree. Returns NULL if the range or memory is short;
+// '*no_frames' is set in the second case, where the bins could not back
+// the request either.
+static void* large_alloc(size_t size, int* no_frames) {
+    void* ptr = vmalloc_owned(size, PMM_OWNER_HEAP);
+    if (!ptr) {
+        *no_frames = (size + PAGE_SIZE - 1) / PAGE_SIZE > pmm_get_free_memory() / PAGE_SIZE;
+        return NULL;
+    }
+    __atomic_add_fetch(&large_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&large_bytes, vmalloc_size(ptr), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&large_total, 1, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+static void large_free(void* ptr) {
+    size_t size = vmalloc_size(ptr);
+    vfree(ptr);
+    __atomic_sub_fetch(&large_count, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&large_bytes, size, __ATOMIC_RELAXED);
+}
+
+// Bytes usable at 'ptr'
+static size_t usable_size(void* ptr) {
+    return is_vmalloc_addr(ptr) ? vmalloc_size(ptr) : block_from_ptr(ptr)->size;
+}
+
+static void* heap_alloc(size_t size) {
+    if (size == 0 || size > MAX_REQUEST) return NULL;
+
+    if (size >= KHEAP_LARGE_THRESHOLD) {
+        // Only a full vmalloc range sends the request to the bins
+        int no_frames = 0;
+        void* ptr = large_alloc(size, &no_frames);
+        if (ptr || no_frames) return ptr;
+    }
+
+    if (size <= KHEAP_CACHE_MAX) {
+        void* ptr = cache_alloc(size_to_class[(size + ALIGN_SIZE - 1) / ALIGN_SIZE]);
+        if (ptr) return ptr;
+    }
+
+    size_t aligned_size = align(size);
+    if (aligned_size < MIN_BLOCK) aligned_size = MIN_BLOCK;
+
+    spinlock_acquire(&heap_lock);
+    block_header_t* block = heap_take(aligned_size);
+    spinlock_release(&heap_lock);
+
+    return block ? block_data(block) : NULL;
+}
+
+void* kmalloc(size_t size) {
+    void* ptr = heap_alloc(size);
+    PROFILE_ALLOC(ptr, __builtin_return_address(0));
+    return ptr;
+}
+
+static void* heap_alloc_aligned(size_t size, size_t alignment) {
+    if (alignment & (alignment - 1)) return NULL;
+    // Large allocations are page aligned
+    if (alignment <= ALIGN_SIZE || (alignment <= PAGE_SIZE && size >= KHEAP_LARGE_THRESHOLD)) {
+        return heap_alloc(size);
+    }
+    if (size == 0 || size > MAX_REQUEST || alignment > MAX_REQUEST) return NULL;
+
+    size_t aligned_size = align(size);
+    if (aligned_size < MIN_BLOCK) aligned_size = MIN_BLOCK;
+
+    spinlock_acquire(&heap_lock);
+    block_header_t* block = heap_take_aligned(aligned_size, alignment);
     spinlock_release(&heap_lock);
-    
-    if (block) {
-        return (void*)((uint64_t)block + HEADER_SIZE);
+
+    return block ? block_data(block) : NULL;
+}
+
+void* kmalloc_aligned(size_t size, size_t alignment) {
+    void* ptr = heap_alloc_aligned(size, alignment);
+    PROFILE_ALLOC(ptr, __builtin_return_address(0));
+    return ptr;
+}
+
+void* kmalloc_pages(size_t count) {
+    if (count == 0) return NULL;
+
+    void* phys = pmm_alloc_pages(count);
+    if (!phys) return NULL;
+    pmm_set_owner(phys, count, PMM_OWNER_HEAP);
+
+    // Demand-paged heap frames keep 'private' at 0; a run is told apart by
+    // its length there
+    pmm_phys_to_page((uint64_t)phys)->private = count;
+
+    __atomic_add_fetch(&page_runs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&page_frames, count, __ATOMIC_RELAXED);
+    return (void*)((uint64_t)phys + hhdm_offset);
+}
+
+void kfree_pages(void* ptr) {
+    if (ptr == NULL) return;
+
+    uint64_t phys = (uint64_t)ptr - hhdm_offset;
+    page_t* page = pmm_phys_to_page(phys);
+    if ((phys & (PAGE_SIZE - 1)) || !page || page->owner != PMM_OWNER_HEAP || !page->private) {
+        panic("Heap: kfree_pages() of memory kmalloc_pages() did not return!");
     }
-    
-    return NULL; // Should be unreachable
+
+    size_t count = page->private;
+    page->private = 0;
+    pmm_free_pages((void*)phys, count);
+
+    __atomic_sub_fetch(&page_runs, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&page_frames, count, __ATOMIC_RELAXED);
+}
+
+uint64_t kvirt_to_phys(const void* ptr) {
+    uint64_t va = (uint64_t)ptr;
+
+    // The HHDM ends well below the heap; it is a subtraction away
+    if (va >= hhdm_offset && va < KHEAP_START) {
+        return va - hhdm_offset;
+    }
+    return vmm_virt_to_phys(vmm_get_kernel_pml4(), va);
 }
 
 void kfree(void* ptr) {
     if (ptr == NULL) return;
-    
-    spinlock_acquire(&heap_lock);
 
-    block_header_t* block = (block_header_t*)((uint64_t)ptr - HEADER_SIZE);
-    
+    if (is_vmalloc_addr(ptr)) {
+        large_free(ptr);
+        return;
+    }
+
+    block_header_t* block = block_from_ptr(ptr);
     if (block->magic != HEAP_MAGIC) {
-        spinlock_release(&heap_lock);
         panic("Heap corruption detected during kfree!");
     }
-    
-    block->is_free = 1;
-    
-    // Coalesce Right
-    if (block->next && block->next->is_free) {
-        block->size += HEADER_SIZE + block->next->size;
-        
-        // If the next block was the tail, this block becomes the tail
-        if (block->next == heap_tail) {
-            heap_tail = block;
-        }
-        
-        block->next = block->next->next;
-        if (block->next) block->next->prev = block;
-    }
-    
-    // Coalesce Left
-    if (block->prev && block->prev->is_free) {
-        block->prev->size += HEADER_SIZE + block->size;
-        
-        // If this block was the tail, the previous block becomes the tail
-        if (block == heap_tail) {
-            heap_tail = block->prev;
-        }
-        
-        block->prev->next = block->next;
-        if (block->next) block->next->prev = block->prev;
+    if (block->is_free || block->cached) {
+        panic("Heap: Double free detected!");
+    }
+    if (block->site) {
+        profile_free(block);
+    }
+
+    if (block->size_class) {
+        cache_free(block);
+        return;
     }
 
+    spinlock_acquire(&heap_lock);
+    heap_put(block);
     spinlock_release(&heap_lock);
 }
 
@@ -238,55 +842,333 @@ void* kcalloc(size_t num, size_t size) {
     }
 
     size_t total = num * size;
-    void* ptr = kmalloc(total);
-    if (ptr) {
+    void* ptr = heap_alloc(total);
+    PROFILE_ALLOC(ptr, __builtin_return_address(0));
+    if (ptr && is_vmalloc_addr(ptr)) {
+        // Large allocations come straight from the PMM, not cleared
         memset(ptr, 0, total);
+    } else if (ptr) {
+        // Memory that was never written needs no clearing (and clearing it
+        // would fault in every page)
+        block_header_t* block = block_from_ptr(ptr);
+        if (!block->is_zeroed) {
+            memset(ptr, 0, total);
+        }
+        block->is_zeroed = 0;
     }
     return ptr;
 }
 
-void* krealloc(void* ptr, size_t new_size) {
-    if (!ptr) return kmalloc(new_size);
+// Grow or shrink an allocated block where it stands, to 'size' (aligned)
+// bytes. Returns 0 if it has to move.
+static int resize_in_place(block_header_t* block, size_t size) {
+    if (size <= block->size) {
+        // Blocks from the per-CPU caches keep their class size
+        block_header_t* rest = NULL;
+        if (!block->size_class) {
+            spinlock_acquire(&heap_lock);
+            rest = split_off(block, size);
+            if (rest) heap_put(rest);
+            spinlock_release(&heap_lock);
+        }
+        if (rest) __atomic_add_fetch(&realloc_shrunk, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&copy_avoided, size, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    spinlock_acquire(&heap_lock);
+    size_t old_size = block->size;
+    block_header_t* next = next_phys(block);
+
+    // Room at the end of the heap is only an expansion away
+    if (!next || (next == heap_tail && next->is_free &&
+                  old_size + HEADER_SIZE + next->size < size)) {
+        if (heap_expand(size - old_size)) {
+            next = next_phys(block);
+        }
+    }
+
+    if (!next || !next->is_free || old_size + HEADER_SIZE + next->size < size) {
+        spinlock_release(&heap_lock);
+        return 0;
+    }
+
+    check_block(next, "Heap corruption detected during krealloc!");
+    bin_remove(next);
+    block->is_zeroed = 0;
+    absorb(block, next);
+    split_block(block, size);
+    // Now sized apart from the cache classes: it is freed to the bins
+    block->size_class = 0;
+
+    realloc_grown++;
+    copy_avoided += old_size;
+    spinlock_release(&heap_lock);
+    return 1;
+}
+
+static void* heap_realloc(void* ptr, size_t new_size, void* caller) {
+    if (!ptr) {
+        ptr = heap_alloc(new_size);
+        PROFILE_ALLOC(ptr, caller);
+        return ptr;
+    }
     if (new_size == 0) {
         kfree(ptr);
         return NULL;
     }
-    
-    // We need to check the size without holding the lock yet, 
-    // but accessing the header is safe as long as we own the pointer.
-    block_header_t* block = (block_header_t*)((uint64_t)ptr - HEADER_SIZE);
-    if (block->size >= new_size) return ptr; 
-    
-    void* new_ptr = kmalloc(new_size);
+    if (new_size > MAX_REQUEST) return NULL;
+
+    if (is_vmalloc_addr(ptr)) {
+        // Large allocations only move, unless the area already fits
+        size_t old_size = vmalloc_size(ptr);
+        if (new_size <= old_size && new_size >= KHEAP_LARGE_THRESHOLD) {
+            __atomic_add_fetch(&copy_avoided, new_size, __ATOMIC_RELAXED);
+            return ptr;
+        }
+        void* new_ptr = heap_alloc(new_size);
+        PROFILE_ALLOC(new_ptr, caller);
+        if (new_ptr) {
+            size_t copy = min(old_size, new_size);
+            memcpy(new_ptr, ptr, copy);
+            large_free(ptr);
+            __atomic_add_fetch(&realloc_moved, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&copy_done, copy, __ATOMIC_RELAXED);
+        }
+        return new_ptr;
+    }
+
+    // The header is safe to read as long as we own the pointer
+    block_header_t* block = block_from_ptr(ptr);
+    if (block->magic != HEAP_MAGIC) {
+        panic("Heap corruption detected during krealloc!");
+    }
+
+    size_t aligned_size = align(new_size);
+    if (aligned_size < MIN_BLOCK) aligned_size = MIN_BLOCK;
+    size_t old_size = block->size;
+    if (resize_in_place(block, aligned_size)) {
+        if (block->site) profile_resize(block, old_size);
+        return ptr;
+    }
+
+    void* new_ptr = heap_alloc(new_size);
+    PROFILE_ALLOC(new_ptr, caller);
     if (new_ptr) {
         // Safe copy size
-        memcpy(new_ptr, ptr, min(block->size, new_size));
+        size_t copy = min(block->size, new_size);
+        memcpy(new_ptr, ptr, copy);
         kfree(ptr);
+        __atomic_add_fetch(&realloc_moved, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&copy_done, copy, __ATOMIC_RELAXED);
     }
     return new_ptr;
 }
 
-void kheap_print_stats(void) {
-    // Note: iterating without lock is technically unsafe if other cores are active,
-    // but for debug prints it's usually acceptable.
-    block_header_t* current = heap_start;
-    size_t free_bytes = 0;
-    size_t used_bytes = 0;
-    size_t free_blocks = 0;
-    size_t used_blocks = 0;
-    
-    while (current) {
-        if (current->is_free) {
-            free_bytes += current->size;
-            free_blocks++;
+void* krealloc(void* ptr, size_t new_size) {
+    return heap_realloc(ptr, new_size, __builtin_return_address(0));
+}
+
+void* krealloc_array(void* ptr, size_t* capacity, size_t count, size_t elem_size) {
+    size_t cap = ptr ? *capacity : 0;
+    if (ptr && count <= cap) return ptr;
+    if (elem_size == 0) return NULL;
+
+    // Half as much again each time: appending one at a time reallocates a
+    // logarithmic number of times, and in-place growth keeps most of those
+    // from copying
+    if (cap < KREALLOC_ARRAY_MIN) cap = KREALLOC_ARRAY_MIN;
+    while (cap < count) {
+        cap = (cap > SIZE_MAX / 3) ? count : cap + cap / 2;
+    }
+    if (cap > SIZE_MAX / elem_size) return NULL;
+
+    void* new_ptr = heap_realloc(ptr, cap * elem_size, __builtin_return_address(0));
+    if (new_ptr) {
+        // Whatever the block rounded up to is usable too
+        *capacity = usable_size(new_ptr) / elem_size;
+    }
+    return new_ptr;
+}
+
+static inline uint64_t page_up(uint64_t addr) {
+    return (addr + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+static inline uint64_t page_down(uint64_t addr) {
+    return addr & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+// Pull the heap end back toward KHEAP_TRIM_KEEP past a large free tail
+// block, by at most '*budget' pages. Lock held.
+static uint64_t trim_tail(uint64_t* budget) {
+    block_header_t* tail = heap_tail;
+    if (!tail->is_free || (tail->size < KHEAP_TRIM_THRESHOLD && !tail_trimming)) {
+        tail_trimming = 0;
+        return 0;
+    }
+
+    uint64_t new_end = page_up((uint64_t)block_data(tail) + KHEAP_TRIM_KEEP);
+    if (new_end < KHEAP_START + KHEAP_INITIAL_SIZE) {
+        new_end = KHEAP_START + KHEAP_INITIAL_SIZE;
+    }
+    if (new_end >= heap_current_end) {
+        tail_trimming = 0;
+        return 0;
+    }
+
+    // From the top down, so the end stays consistent after every step
+    uint64_t old_end = heap_current_end;
+    tail_trimming = ((old_end - new_end) / PAGE_SIZE > *budget);
+    if (tail_trimming) {
+        new_end = old_end - *budget * PAGE_SIZE;
+    }
+    *budget -= (old_end - new_end) / PAGE_SIZE;
+
+    bin_remove(tail);
+    tail->size = new_end - (uint64_t)block_data(tail);
+    bin_insert(tail);
+    heap_current_end = new_end;
+
+    return vmm_release_lazy(new_end, old_end - new_end);
+}
+
+static inline uint64_t* trim_cursor(block_header_t* block) {
+    return (uint64_t*)(block_data(block) + sizeof(free_links_t));
+}
+
+// Give back up to '*budget' of the whole pages inside a large free block,
+// keeping the page with its header, bin links and resume point. Lock held.
+static uint64_t trim_block(block_header_t* block, uint64_t* budget) {
+    uint64_t first = page_up((uint64_t)trim_cursor(block) + sizeof(uint64_t));
+    uint64_t last = page_down((uint64_t)block_data(block) + block->size);
+
+    // Never written since the heap grew: nothing behind it to give back,
+    // and no resume point may be stored in it
+    if (block->is_zeroed) {
+        block->trimmed = TRIM_DONE;
+        return 0;
+    }
+    if (block->trimmed == TRIM_PARTIAL) {
+        first = *trim_cursor(block);
+    }
+    if (last <= first) {
+        block->trimmed = TRIM_DONE;
+        return 0;
+    }
+
+    uint64_t end = last;
+    if ((last - first) / PAGE_SIZE > *budget) {
+        end = first + *budget * PAGE_SIZE;
+    }
+    *budget -= (end - first) / PAGE_SIZE;
+
+    if (end < last) {
+        *trim_cursor(block) = end;
+        block->trimmed = TRIM_PARTIAL;
+    } else {
+        block->trimmed = TRIM_DONE;
+    }
+    return vmm_release_lazy(first, end - first);
+}
+
+int kheap_trim_pending(void) {
+    return __atomic_load_n(&trim_pending, __ATOMIC_RELAXED);
+}
+
+uint64_t kheap_trim(uint64_t max_pages) {
+    if (!kheap_trim_pending()) return 0;
+
+    spinlock_acquire(&heap_lock);
+    trim_pending = 0;
+    uint64_t budget = max_pages;
+    uint64_t pages = trim_tail(&budget);
+
+    // Every free block big enough sits in the bins from the threshold's up
+    int fl, sl;
+    mapping_insert(KHEAP_TRIM_THRESHOLD, &fl, &sl);
+    for (; fl < FL_COUNT && budget; fl++, sl = 0) {
+        if (!(fl_bitmap & (1U << fl))) continue;
+        for (; sl < SL_COUNT && budget; sl++) {
+            block_header_t* block = bins[fl][sl];
+            for (; block && budget; block = block_links(block)->next) {
+                if (block->trimmed != TRIM_DONE && block->size >= KHEAP_TRIM_THRESHOLD) {
+                    pages += trim_block(block, &budget);
+                }
+            }
+        }
+    }
+
+    // Out of budget: carry on from here next time
+    if (budget == 0) {
+        trim_pending = 1;
+    }
+
+    trim_returned += pages;
+    trim_runs++;
+    spinlock_release(&heap_lock);
+    return pages;
+}
+
+// Histogram bucket: one per power of two from 16 bytes, the last open-ended
+static inline int hist_bucket(size_t size) {
+    int bucket = fls64(size) - ALIGN_LOG2;
+    if (bucket < 0) return 0;
+    return (bucket < KHEAP_HIST_BUCKETS) ? bucket : KHEAP_HIST_BUCKETS - 1;
+}
+
+void kheap_get_stats(kheap_stats_t* out) {
+    memset(out, 0, sizeof(*out));
+
+    spinlock_acquire(&heap_lock);
+    out->heap_size = heap_current_end - KHEAP_START;
+    out->trim_runs = trim_runs;
+    out->trimmed_pages = trim_returned;
+    out->realloc_grown = realloc_grown;
+    out->realloc_shrunk = realloc_shrunk;
+    out->realloc_moved = realloc_moved;
+    out->copy_avoided = copy_avoided;
+    out->copy_done = copy_done;
+    out->large_count = large_count;
+    out->large_bytes = large_bytes;
+    out->large_total = large_total;
+    out->page_runs = page_runs;
+    out->page_frames = page_frames;
+    for (block_header_t* current = heap_start; current; current = next_phys(current)) {
+        if (current->cached) {
+            out->cached_bytes += current->size;
+            out->cached_blocks++;
+        } else if (current->is_free) {
+            out->free_bytes += current->size;
+            out->free_blocks++;
+            out->free_hist[hist_bucket(current->size)]++;
+            if (current->size > out->largest_free) out->largest_free = current->size;
         } else {
-            used_bytes += current->size;
-            used_blocks++;
+            out->used_bytes += current->size;
+            out->used_blocks++;
+            out->used_hist[hist_bucket(current->size)]++;
         }
-        current = current->next;
     }
-    
-    printk("Heap Stats: Used: %llu bytes (%llu blocks) | Free: %llu bytes (%llu blocks)\n", 
-           (uint64_t)used_bytes, (uint64_t)used_blocks, 
-           (uint64_t)free_bytes, (uint64_t)free_blocks);
-}
\ No newline at end of file
+    spinlock_release(&heap_lock);
+}
+
+void kheap_get_cpu_stats(uint32_t cpu, kheap_cpu_stats_t* out) {
+    if (cpu >= MAX_CPUS) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    heap_cpu_t* pc = &heap_cpus[cpu];
+    *out = pc->stats;
+    out->cached = 0;
+    for (int class = 0; class < HEAP_CLASSES; class++) {
+        out->cached += pc->mags[class].count;
+    }
+}
+
+void kheap_print_stats(void) {
+    kheap_stats_t stats;
+    kheap_get_stats(&stats);
+
+    printk("Heap Stats: Used: %llu bytes (%llu blocks) | Free: %llu bytes (%llu blocks)\n",
+           stats.used_bytes, stats.used_blocks, stats.free_bytes, stats.free_blocks);
+}
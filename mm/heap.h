@@ -6,24 +6,152 @@
 
 // Heap configuration
 #define KHEAP_START         0xffffa00000000000
+#define KHEAP_MAX_SIZE      (64ULL << 30) // Reserved, backed on demand
 #define KHEAP_INITIAL_SIZE  (1024 * 1024) // Start with 1MB
 #define KHEAP_MIN_SIZE      (4096)        // Minimum expansion size
 
+// Per-CPU kmalloc caches: requests up to KHEAP_CACHE_MAX bytes come from a
+// magazine of at most KHEAP_MAG_DEPTH blocks per size class, which is
+// refilled and flushed KHEAP_MAG_BATCH blocks at a time.
+#define KHEAP_CACHE_MAX     1024
+#define KHEAP_MAG_DEPTH     32
+#define KHEAP_MAG_BATCH     16
+
+// Trimming: free blocks of KHEAP_TRIM_THRESHOLD or more give their whole
+// pages back to the PMM; a free block at the end of the heap is cut down to
+// KHEAP_TRIM_KEEP bytes and the heap end pulled back. The gap between
+// the two keeps a heap hovering around one size from trimming and growing
+// over and over.
+#define KHEAP_TRIM_THRESHOLD (1024 * 1024)
+#define KHEAP_TRIM_KEEP      (256 * 1024)
+
+// Allocations of this size and up bypass the bins: each gets its own
+// vmalloc area, backed by contiguous frames (and 2MB pages) where possible,
+// and goes straight back to the PMM when freed
+#define KHEAP_LARGE_THRESHOLD (256 * 1024)
+
+// Allocation sites the profiler tells apart; more are counted as untracked
+#define KHEAP_PROFILE_SITES  256
+
+// Block size histogram: powers of two from 16 bytes, the last is 1MB and up
+#define KHEAP_HIST_BUCKETS   17
+
+// Smallest capacity krealloc_array() hands out, in elements
+#define KREALLOC_ARRAY_MIN   8
+
 // Initialize the kernel heap
 void kheap_init(void);
 
 // Allocate memory
 void* kmalloc(size_t size);
 
+// Allocate memory whose address is a multiple of 'alignment' (a power of
+// two), e.g. 64 to keep data on its own cache lines or 32 for AVX. Freed
+// with kfree(); krealloc() does not keep the alignment. Like all heap
+// memory it is only virtually contiguous.
+void* kmalloc_aligned(size_t size, size_t alignment);
+
+// Allocate 'count' physically contiguous pages, reached through the HHDM.
+// The run is aligned to 'count' rounded up to a power of two, so 512 pages
+// make a 2MB-aligned run; runs over 1024 pages are only 4MB-aligned (the
+// largest buddy block). Not cleared. Freed with kfree_pages().
+void* kmalloc_pages(size_t count);
+void kfree_pages(void* ptr);
+
+// Physical address behind kernel memory. A subtraction for kmalloc_pages()
+// and other HHDM memory, a page-table walk otherwise; heap memory that was
+// never written has no frame of its own yet, so use kmalloc_pages() for DMA.
+uint64_t kvirt_to_phys(const void* ptr);
+
 // Allocate memory cleared to zero
 void* kcalloc(size_t num, size_t size);
 
 // Reallocate memory (resize)
 void* krealloc(void* ptr, size_t new_size);
 
+// Resize an array to hold at least 'count' elements of 'elem_size' bytes.
+// '*capacity' is the array's capacity in elements; it grows geometrically
+// and is updated on success. On failure NULL is returned and the old array
+// is left alone.
+void* krealloc_array(void* ptr, size_t* capacity, size_t count, size_t elem_size);
+
 // Free memory
 void kfree(void* ptr);
 
+typedef struct {
+    uint64_t heap_size;     // Bytes of heap range in use (backed on demand)
+    uint64_t used_bytes;
+    uint64_t used_blocks;
+    uint64_t free_bytes;
+    uint64_t free_blocks;
+    uint64_t largest_free;  // Biggest single free block
+    uint64_t cached_bytes;  // Freed into the per-CPU caches (not in used_*)
+    uint64_t cached_blocks;
+    uint64_t trim_runs;     // kheap_trim() passes
+    uint64_t trimmed_pages; // Frames given back to the PMM since boot
+    uint64_t realloc_grown; // krealloc calls that grew a block in place
+    uint64_t realloc_shrunk;// ...that split off the end of a block
+    uint64_t realloc_moved; // ...that had to allocate and copy
+    uint64_t copy_avoided;  // Bytes in-place resizes did not have to copy
+    uint64_t copy_done;     // Bytes copied by moves
+    uint64_t large_count;   // Large allocations outstanding
+    uint64_t large_bytes;   // ...and the bytes mapped for them
+    uint64_t large_total;   // Large allocations made since boot
+    uint64_t page_runs;     // kmalloc_pages() runs outstanding
+    uint64_t page_frames;   // ...and the frames in them
+    uint64_t used_hist[KHEAP_HIST_BUCKETS];
+    uint64_t free_hist[KHEAP_HIST_BUCKETS];
+} kheap_stats_t;
+
+typedef struct {
+    uint64_t hits;              // kmalloc calls served from a magazine
+    uint64_t misses;            // kmalloc calls that found the magazine empty
+    uint64_t frees;             // kfree calls absorbed by a magazine
+    uint64_t remote_frees;      // Blocks freed here for another CPU
+    uint64_t remote_drained;    // Blocks other CPUs freed for this one
+    uint64_t refills;           // Batches pulled from the heap
+    uint64_t flushes;           // Batches returned to the heap
+    uint64_t cached;            // Blocks currently held
+} kheap_cpu_stats_t;
+
+// Give the whole free pages of large free blocks, and of the heap tail, back
+// to the PMM, going over at most 'max_pages' pages per call (interrupts are
+// off meanwhile). Cheap when there is nothing to do; meant for the idle
+// loop. Returns the number of frames freed.
+uint64_t kheap_trim(uint64_t max_pages);
+
+// Nonzero while kheap_trim() has work left
+int kheap_trim_pending(void);
+
+// Walk every block (slow: for diagnostics only)
+void kheap_get_stats(kheap_stats_t* out);
+
+// Per-CPU cache counters
+void kheap_get_cpu_stats(uint32_t cpu, kheap_cpu_stats_t* out);
+
+// Allocation-site profiling. Off by default; when off, the allocation
+// calls pay one untaken branch. When on, each allocation is charged to the
+// return address of its kmalloc/kcalloc/krealloc/kmalloc_aligned call.
+typedef struct {
+    uint64_t caller;        // Return address of the allocating call
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t live_blocks;
+    uint64_t live_bytes;
+    uint64_t total_bytes;   // Allocated over the whole profile
+    uint64_t min_size;      // Smallest and largest block handed out
+    uint64_t max_size;
+    uint64_t first_ms;      // Uptime of the first and latest allocation
+    uint64_t last_ms;
+} kheap_site_t;
+
+void kheap_profile_enable(int on);
+int kheap_profile_enabled(void);
+
+// Copy up to 'max' sites to 'out' and return how many were copied.
+// '*dropped' (if not NULL) gets the allocations no site slot was left for.
+uint32_t kheap_get_sites(kheap_site_t* out, uint32_t max, uint64_t* dropped);
+
 // Debug: Print heap status
 void kheap_print_stats(void);
 
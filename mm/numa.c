@@ -0,0 +1,241 @@
+#include "numa.h"
+#include "pmm.h"
+#include "../drivers/acpi.h"
+#include "../arch/cpu.h"
+#include "../lib/string.h"
+#include "../lib/printk.h"
+
+#define MAX_NUMA_RANGES 32
+#define MAX_APIC_IDS    256
+
+typedef struct {
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint32_t node;
+} numa_range_t;
+
+// Memory ranges sorted by start_pfn
+static numa_range_t ranges[MAX_NUMA_RANGES];
+static uint32_t range_count = 0;
+
+static uint32_t node_count = 1;
+static uint32_t node_domain[MAX_NUMNODES];
+static uint8_t distance[MAX_NUMNODES][MAX_NUMNODES];
+static uint32_t fallback[MAX_NUMNODES][MAX_NUMNODES];
+
+// APIC ID -> node, filled from SRAT processor entries (0xFF = unknown)
+static uint8_t apic_node[MAX_APIC_IDS];
+static uint32_t cpu_node[MAX_CPUS];
+
+// Map an ACPI proximity domain to a dense node ID, creating one if needed.
+// Returns MAX_NUMNODES when the table has more domains than we support.
+static uint32_t domain_to_node(uint32_t domain) {
+    for (uint32_t n = 0; n < node_count; n++) {
+        if (node_domain[n] == domain) return n;
+    }
+    if (node_count >= MAX_NUMNODES) return MAX_NUMNODES;
+    node_domain[node_count] = domain;
+    return node_count++;
+}
+
+static void add_range(uint64_t base, uint64_t length, uint32_t node) {
+    if (range_count >= MAX_NUMA_RANGES) {
+        printk("[NUMA] Warning: too many memory ranges, ignoring 0x%llx\n", base);
+        return;
+    }
+
+    numa_range_t r = {
+        .start_pfn = base / PAGE_SIZE,
+        .end_pfn = (base + length) / PAGE_SIZE,
+        .node = node,
+    };
+
+    // Insertion sort keeps the table ordered for lookups
+    uint32_t i = range_count++;
+    while (i > 0 && ranges[i - 1].start_pfn > r.start_pfn) {
+        ranges[i] = ranges[i - 1];
+        i--;
+    }
+    ranges[i] = r;
+}
+
+static void parse_srat(acpi_srat_t* srat) {
+    // Domains are only known once the table has been read, so start from zero
+    node_count = 0;
+
+    uint8_t* start = (uint8_t*)(srat + 1);
+    uint8_t* end = (uint8_t*)srat + srat->header.length;
+
+    // Stop at an entry that runs past the table; skip ones too short for their type
+    while (start + 2 <= end) {
+        uint8_t type = start[0];
+        uint8_t length = start[1];
+        if (length == 0 || start + length > end) break;
+
+        switch (type) {
+            case SRAT_LAPIC_AFFINITY: {
+                acpi_srat_lapic_t* cpu = (acpi_srat_lapic_t*)start;
+                if (length < sizeof(*cpu) || !(cpu->flags & SRAT_ENABLED)) break;
+                uint32_t domain = cpu->proximity_domain_lo |
+                                  (cpu->proximity_domain_hi[0] << 8) |
+                                  (cpu->proximity_domain_hi[1] << 16) |
+                                  (cpu->proximity_domain_hi[2] << 24);
+                uint32_t node = domain_to_node(domain);
+                if (node < MAX_NUMNODES) apic_node[cpu->apic_id] = node;
+                break;
+            }
+            case SRAT_X2APIC_AFFINITY: {
+                acpi_srat_x2apic_t* cpu = (acpi_srat_x2apic_t*)start;
+                if (length < sizeof(*cpu) || !(cpu->flags & SRAT_ENABLED) || cpu->x2apic_id >= MAX_APIC_IDS) break;
+                uint32_t node = domain_to_node(cpu->proximity_domain);
+                if (node < MAX_NUMNODES) apic_node[cpu->x2apic_id] = node;
+                break;
+            }
+            case SRAT_MEMORY_AFFINITY: {
+                acpi_srat_memory_t* mem = (acpi_srat_memory_t*)start;
+                if (length < sizeof(*mem) || !(mem->flags & SRAT_ENABLED) || mem->length_bytes == 0) break;
+                uint32_t node = domain_to_node(mem->proximity_domain);
+                if (node < MAX_NUMNODES) add_range(mem->base_address, mem->length_bytes, node);
+                break;
+            }
+        }
+        start += length;
+    }
+
+    if (node_count == 0) {
+        node_count = 1;
+        node_domain[0] = 0;
+    }
+}
+
+static void parse_slit(acpi_slit_t* slit) {
+    uint8_t* matrix = (uint8_t*)(slit + 1);
+    uint64_t localities = slit->locality_count;
+
+    // The matrix has to fit in the table (checked without overflowing)
+    uint64_t room = (slit->header.length > sizeof(acpi_slit_t)) ?
+                    slit->header.length - sizeof(acpi_slit_t) : 0;
+    if (localities == 0 || localities > room || localities * localities > room) {
+        printk("[NUMA] Warning: SLIT too short for %llu localities, ignoring it\n", localities);
+        return;
+    }
+
+    for (uint32_t from = 0; from < node_count; from++) {
+        for (uint32_t to = 0; to < node_count; to++) {
+            if (node_domain[from] < localities && node_domain[to] < localities) {
+                distance[from][to] = matrix[node_domain[from] * localities + node_domain[to]];
+            }
+        }
+    }
+}
+
+static void build_fallback_lists(void) {
+    for (uint32_t node = 0; node < node_count; node++) {
+        uint32_t* list = fallback[node];
+        for (uint32_t i = 0; i < node_count; i++) {
+            list[i] = i;
+        }
+        // Selection sort by distance; the node itself always comes first (distance 10)
+        for (uint32_t i = 0; i < node_count; i++) {
+            uint32_t best = i;
+            for (uint32_t j = i + 1; j < node_count; j++) {
+                uint32_t a = list[j], b = list[best];
+                if (distance[node][a] < distance[node][b] ||
+                    (distance[node][a] == distance[node][b] && a == node)) {
+                    best = j;
+                }
+            }
+            uint32_t tmp = list[i];
+            list[i] = list[best];
+            list[best] = tmp;
+        }
+    }
+}
+
+void numa_init(void) {
+    memset(apic_node, 0xFF, sizeof(apic_node));
+    node_count = 1;
+    node_domain[0] = 0;
+    range_count = 0;
+
+    acpi_srat_t* srat = (acpi_srat_t*)acpi_find_table("SRAT");
+    if (srat) {
+        parse_srat(srat);
+    }
+
+    // Default distances, overridden by the SLIT when present
+    for (uint32_t from = 0; from < MAX_NUMNODES; from++) {
+        for (uint32_t to = 0; to < MAX_NUMNODES; to++) {
+            distance[from][to] = (from == to) ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    acpi_slit_t* slit = (acpi_slit_t*)acpi_find_table("SLIT");
+    if (srat && slit) {
+        parse_slit(slit);
+    }
+
+    build_fallback_lists();
+    numa_set_cpu_apic_id(0, cpu_apic_id());
+
+    if (!srat) {
+        printk("[NUMA] No SRAT, treating memory as a single node.\n");
+        return;
+    }
+
+    printk("[NUMA] %u node(s), %u memory range(s)%s\n",
+           node_count, range_count, slit ? ", SLIT present" : "");
+    for (uint32_t i = 0; i < range_count; i++) {
+        printk("[NUMA]   Node %u: 0x%llx - 0x%llx\n", ranges[i].node,
+               ranges[i].start_pfn * PAGE_SIZE, ranges[i].end_pfn * PAGE_SIZE);
+    }
+}
+
+uint32_t numa_node_count(void) {
+    return node_count;
+}
+
+uint32_t numa_pfn_to_node(uint64_t pfn) {
+    if (node_count == 1) return 0;
+
+    for (uint32_t i = 0; i < range_count; i++) {
+        if (pfn < ranges[i].start_pfn) break;
+        if (pfn < ranges[i].end_pfn) return ranges[i].node;
+    }
+    return 0;
+}
+
+uint64_t numa_pfn_range_end(uint64_t pfn) {
+    for (uint32_t i = 0; i < range_count; i++) {
+        if (pfn < ranges[i].start_pfn) return ranges[i].start_pfn;
+        if (pfn < ranges[i].end_pfn) return ranges[i].end_pfn;
+    }
+    return ~0ULL;
+}
+
+uint32_t numa_cpu_to_node(uint32_t cpu) {
+    return (cpu < MAX_CPUS) ? cpu_node[cpu] : 0;
+}
+
+uint32_t numa_local_node(void) {
+    return cpu_node[cpu_current_id()];
+}
+
+void numa_set_cpu_apic_id(uint32_t cpu, uint32_t apic_id) {
+    if (cpu >= MAX_CPUS) return;
+    uint32_t node = (apic_id < MAX_APIC_IDS) ? apic_node[apic_id] : 0xFF;
+    cpu_node[cpu] = (node < node_count) ? node : 0;
+}
+
+uint8_t numa_distance(uint32_t from, uint32_t to) {
+    if (from >= node_count || to >= node_count) return 0xFF;
+    return distance[from][to];
+}
+
+const uint32_t* numa_fallback_list(uint32_t node) {
+    return fallback[(node < node_count) ? node : 0];
+}
+
+uint32_t numa_node_domain(uint32_t node) {
+    return (node < node_count) ? node_domain[node] : 0;
+}
@@ -0,0 +1,42 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdint.h>
+
+// Upper bound on NUMA nodes the memory manager keeps separate lists for
+#define MAX_NUMNODES 8
+
+// Distance reported between two nodes when there is no SLIT (ACPI convention)
+#define NUMA_LOCAL_DISTANCE   10
+#define NUMA_REMOTE_DISTANCE  20
+
+// Parse SRAT/SLIT. Must run after acpi_init() and before pmm_init().
+// Without an SRAT the whole machine is node 0.
+void numa_init(void);
+
+uint32_t numa_node_count(void);
+
+// Node owning a physical frame. Frames outside every SRAT range belong to node 0.
+uint32_t numa_pfn_to_node(uint64_t pfn);
+
+// First frame after 'pfn' at which the owning node may change
+uint64_t numa_pfn_range_end(uint64_t pfn);
+
+// Node of a CPU (by cpu_current_id() index) and of the executing CPU
+uint32_t numa_cpu_to_node(uint32_t cpu);
+uint32_t numa_local_node(void);
+
+// Record the node of a CPU from its APIC ID (called as CPUs come online)
+void numa_set_cpu_apic_id(uint32_t cpu, uint32_t apic_id);
+
+// Relative access cost between two nodes (10 = local)
+uint8_t numa_distance(uint32_t from, uint32_t to);
+
+// Nodes ordered by distance from 'node', nearest (itself) first.
+// The list has numa_node_count() entries.
+const uint32_t* numa_fallback_list(uint32_t node);
+
+// ACPI proximity domain a node was created from
+uint32_t numa_node_domain(uint32_t node);
+
+#endif
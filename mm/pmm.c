@@ -2,29 +2,340 @@
 #include "../lib/bitmap.h"
 #include "../lib/string.h"
 #include "../lib/printk.h"
+#include "../lib/panic.h"
+#include "../lib/spinlock.h"
+#include "../arch/cpu.h"
+#include "numa.h"
+
+// Free blocks are linked through their own first bytes (accessed via the HHDM),
+// so the free lists cost no memory beyond the list heads. Each block also
+// remembers its zone, so merging never has to look up a buddy's NUMA node.
+struct pmm_zone;
+
+typedef struct free_block {
+    struct free_block* next;
+    struct free_block* prev;
+    struct pmm_zone* zone;
+} free_block_t;
+
+#define ORDER_NONE PAGE_ORDER_NONE
 
 // Global PMM state
-static uint8_t *bitmap = NULL;
-static uint64_t bitmap_size = 0;       // Size of bitmap in bytes
+static hbitmap_t frame_map;            // 1 = used, 0 = free (kept in sync with the buddy lists)
+static uint64_t bitmap_size = 0;       // Size of the frame map storage in bytes
+static page_t *page_db = NULL;         // Frame database, one page_t per frame
+static uint64_t owner_pages[PMM_OWNER_COUNT];
 static uint64_t highest_page = 0;      // Highest physical page index
-static uint64_t free_memory = 0;
-static uint64_t used_memory = 0;
 static uint64_t total_memory = 0;
+static uint64_t reclaimed_memory = 0;    // Added after boot by pmm_reclaim_range()
 static uint64_t hhdm_offset_global = 0;
 
+// A zone is the part of one NUMA node's memory inside a physical address
+// range, with its own buddy lists. Zone boundaries are aligned far beyond the
+// largest buddy block; node boundaries may not be, so merging only joins
+// blocks tagged with the same zone.
+typedef struct pmm_zone {
+    const char* name;
+    uint32_t node;
+    uint64_t start_pfn;                     // First frame of the zone
+    uint64_t end_pfn;                       // One past the last frame
+    uint64_t present_pages;                 // Usable frames handed over at boot
+    uint64_t free_pages;                    // Frames currently on the lists
+    uint64_t reserve_pages;                 // Kept back from allocations that could use a higher zone
+    free_block_t* free_lists[PMM_MAX_ORDER + 1];
+    uint64_t free_blocks[PMM_MAX_ORDER + 1];
+} pmm_zone_t;
+
+// Frames below 16 MiB that fallback allocations may not touch
+#define DMA16_RESERVE_PAGES 256
+
+#define DMA16_END_PFN  ((16ULL * 1024 * 1024) / PAGE_SIZE)
+#define DMA32_END_PFN  ((4ULL * 1024 * 1024 * 1024) / PAGE_SIZE)
+
+static const char* const zone_names[ZONE_COUNT] = { "DMA16", "DMA32", "Normal" };
+static const uint64_t zone_start_pfn[ZONE_COUNT] = { 0, DMA16_END_PFN, DMA32_END_PFN };
+static const uint64_t zone_end_pfn[ZONE_COUNT] = { DMA16_END_PFN, DMA32_END_PFN, ~0ULL };
+
+// One set of zones per NUMA node. Protected by pmm_lock.
+static pmm_zone_t zones[MAX_NUMNODES][ZONE_COUNT];
+static spinlock_t pmm_lock;
+
+// Per-CPU page cache: a ring of single frames in front of the buddy lists.
+// The hot end holds recently freed (cache-warm) frames, the cold end holds
+// frames that were refilled from the buddy lists or freed as cold.
+// Only the owning CPU touches it, with interrupts disabled, so no lock is taken.
+typedef struct {
+    uint64_t pages[PMM_PCP_HIGH];  // Physical addresses
+    uint32_t head;                 // Index of the hottest frame
+    uint32_t count;
+    pmm_pcp_stats_t stats;
+} pmm_pcp_t;
+
+static pmm_pcp_t pcp[MAX_CPUS];
+
+// Pool of frames that were cleared while the CPU was idle.
+// The frames stay marked used in the frame map while pooled.
+static uint64_t zero_pool[PMM_ZERO_POOL_SIZE];  // Physical addresses
+static uint32_t zero_pool_count = 0;
+static pmm_zero_stats_t zero_stats;
+static spinlock_t zero_lock;
+
 // Helper to convert Physical Address to Virtual (HHDM)
 static inline void* phys_to_virt(uint64_t phys) {
     return (void*)(phys + hhdm_offset_global);
 }
 
+static inline free_block_t* pfn_to_block(uint64_t pfn) {
+    return (free_block_t*)phys_to_virt(pfn * PAGE_SIZE);
+}
+
+static inline uint64_t block_to_pfn(free_block_t* block) {
+    return ((uint64_t)block - hhdm_offset_global) / PAGE_SIZE;
+}
+
+static inline pmm_zone_id_t pfn_to_zone_id(uint64_t pfn) {
+    if (pfn < DMA16_END_PFN) return ZONE_DMA16;
+    if (pfn < DMA32_END_PFN) return ZONE_DMA32;
+    return ZONE_NORMAL;
+}
+
+static inline pmm_zone_t* pfn_to_zone(uint64_t pfn) {
+    return &zones[numa_pfn_to_node(pfn)][pfn_to_zone_id(pfn)];
+}
+
+// Smallest order whose block holds at least 'count' pages
+static inline unsigned int order_for_count(size_t count) {
+    unsigned int order = 0;
+    while (((size_t)1 << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+// The zone lookup scans the NUMA ranges, so the buddy code below takes the
+// zone from its caller instead and only uses this where a run enters.
+static void buddy_list_add(pmm_zone_t* zone, uint64_t pfn, unsigned int order) {
+    free_block_t* block = pfn_to_block(pfn);
+    block->zone = zone;
+    block->prev = NULL;
+    block->next = zone->free_lists[order];
+    if (zone->free_lists[order]) {
+        zone->free_lists[order]->prev = block;
+    }
+    zone->free_lists[order] = block;
+    zone->free_blocks[order]++;
+    zone->free_pages += 1ULL << order;
+    page_db[pfn].order = order;
+}
+
+static void buddy_list_del(pmm_zone_t* zone, uint64_t pfn, unsigned int order) {
+    free_block_t* block = pfn_to_block(pfn);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        zone->free_lists[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    zone->free_blocks[order]--;
+    zone->free_pages -= 1ULL << order;
+    page_db[pfn].order = ORDER_NONE;
+}
+
+// Insert a naturally aligned block and merge it with its buddy as far as possible.
+// The block must lie in 'zone'.
+static void buddy_free_block(pmm_zone_t* zone, uint64_t pfn, unsigned int order) {
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = pfn ^ (1ULL << order);
+        if (buddy >= highest_page || page_db[buddy].order != order ||
+            pfn_to_block(buddy)->zone != zone) {
+            break;
+        }
+        buddy_list_del(zone, buddy, order);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+    buddy_list_add(zone, pfn, order);
+}
+
+// Insert an arbitrary run of pages in 'zone' as the largest aligned blocks that fit.
+static void buddy_free_range(pmm_zone_t* zone, uint64_t pfn, uint64_t count) {
+    while (count > 0) {
+        unsigned int order = PMM_MAX_ORDER;
+        while (order > 0 && ((pfn & ((1ULL << order) - 1)) != 0 || (1ULL << order) > count)) {
+            order--;
+        }
+        buddy_free_block(zone, pfn, order);
+        pfn += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+// Take a block of exactly 'order' from 'zone', splitting a larger one if needed.
+// Returns the first PFN, or -1 when no block is large enough.
+static int64_t buddy_alloc_block(pmm_zone_t* zone, unsigned int order) {
+    unsigned int current = order;
+    while (current <= PMM_MAX_ORDER && zone->free_lists[current] == NULL) {
+        current++;
+    }
+    if (current > PMM_MAX_ORDER) {
+        return -1;
+    }
+
+    uint64_t pfn = block_to_pfn(zone->free_lists[current]);
+    buddy_list_del(zone, pfn, current);
+
+    // Give the upper halves back until the block has the requested size
+    while (current > order) {
+        current--;
+        buddy_list_add(zone, pfn + (1ULL << current), current);
+    }
+    return (int64_t)pfn;
+}
+
+// Find the free block that contains 'pfn'. Returns its head, order in *order_out.
+static uint64_t buddy_find_block(uint64_t pfn, unsigned int* order_out) {
+    for (unsigned int order = 0; order <= PMM_MAX_ORDER; order++) {
+        uint64_t head = pfn & ~((1ULL << order) - 1);
+        if (page_db[head].order == order) {
+            *order_out = order;
+            return head;
+        }
+    }
+    *order_out = ORDER_NONE;
+    return pfn;
+}
+
+// Pull a free run [pfn, pfn + count) out of the buddy lists.
+// Used for requests larger than the biggest buddy block; the run lies in one zone.
+static void buddy_claim_range(uint64_t pfn, uint64_t count) {
+    pmm_zone_t* zone = pfn_to_zone(pfn);
+    uint64_t end = pfn + count;
+    uint64_t left_start = pfn, right_end = end;
+    uint64_t current = pfn;
+
+    // Remove every block overlapping the run first. The fragments sticking out on
+    // either side are only returned afterwards so they cannot coalesce back into it.
+    while (current < end) {
+        unsigned int order;
+        uint64_t head = buddy_find_block(current, &order);
+        buddy_list_del(zone, head, order);
+        if (head < left_start) left_start = head;
+        current = head + (1ULL << order);
+        if (current > right_end) right_end = current;
+    }
+
+    if (left_start < pfn) buddy_free_range(zone, left_start, pfn - left_start);
+    if (right_end > end)  buddy_free_range(zone, end, right_end - end);
+}
+
+// Can 'zone' give up 'pages' frames to a request allowed in 'zone_mask'?
+// Lower zones keep their reserve for requests that could not go higher.
+static int zone_has_room(pmm_zone_t* zone, pmm_zone_id_t id, uint64_t pages, uint32_t zone_mask) {
+    uint64_t reserve = (zone_mask >> (id + 1)) ? zone->reserve_pages : 0;
+    return zone->free_pages >= pages + reserve;
+}
+
+// Allocate a block of 'order'. Nodes are tried nearest first starting at
+// 'node'; within a node, the highest allowed zone that has room wins.
+static int64_t buddy_alloc_zoned(unsigned int order, uint32_t zone_mask, uint32_t node) {
+    const uint32_t* nodes = numa_fallback_list(node);
+    for (uint32_t n = 0; n < numa_node_count(); n++) {
+        for (int id = ZONE_COUNT - 1; id >= 0; id--) {
+            pmm_zone_t* zone = &zones[nodes[n]][id];
+            if (!(zone_mask & ZONE_MASK(id)) || !zone_has_room(zone, id, 1ULL << order, zone_mask)) {
+                continue;
+            }
+            int64_t pfn = buddy_alloc_block(zone, order);
+            if (pfn >= 0) return pfn;
+        }
+    }
+    return -1;
+}
+
+// Find a free run of 'count' frames starting on a multiple of 'align' (a power
+// of two) inside one allowed zone of one node, in the same preference order
+// as buddy_alloc_zoned()
+static int64_t frame_map_find_zoned(uint64_t count, uint64_t align, uint32_t zone_mask, uint32_t node) {
+    const uint32_t* nodes = numa_fallback_list(node);
+    for (uint32_t n = 0; n < numa_node_count(); n++) {
+        for (int id = ZONE_COUNT - 1; id >= 0; id--) {
+            pmm_zone_t* zone = &zones[nodes[n]][id];
+            if (!(zone_mask & ZONE_MASK(id)) || !zone_has_room(zone, id, count, zone_mask)) {
+                continue;
+            }
+
+            uint64_t start = zone->start_pfn;
+            for (;;) {
+                start = hbitmap_find_next_zero_range(&frame_map, start, count);
+                if (start == HBITMAP_NOT_FOUND || start + count > zone->end_pfn) break;
+                if (start & (align - 1)) {
+                    start = (start + align - 1) & ~(align - 1);
+                    continue;
+                }
+
+                // The run must not cross into another node's memory
+                uint64_t range_end = numa_pfn_range_end(start);
+                if (numa_pfn_to_node(start) == nodes[n] && start + count <= range_end) {
+                    return (int64_t)start;
+                }
+                start = range_end;
+            }
+        }
+    }
+    return -1;
+}
+
+// Hand the whole pages inside [start, end) to the buddy allocator as present,
+// free memory. Returns the number of pages added. Caller holds pmm_lock
+// (or is pmm_init).
+static uint64_t add_free_region(uint64_t start, uint64_t end) {
+    uint64_t start_pfn = (start + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t end_pfn = end / PAGE_SIZE;
+    if (end_pfn > highest_page) end_pfn = highest_page;
+    if (end_pfn <= start_pfn) {
+        return 0;
+    }
+
+    hbitmap_clear_range(&frame_map, start_pfn, end_pfn - start_pfn);
+    for (uint64_t pfn = start_pfn; pfn < end_pfn; pfn++) {
+        page_db[pfn].flags &= ~PG_RESERVED;
+    }
+
+    // Split the region at zone and NUMA node boundaries
+    for (uint64_t pfn = start_pfn; pfn < end_pfn; ) {
+        pmm_zone_t* zone = pfn_to_zone(pfn);
+        uint64_t chunk_end = (end_pfn < zone->end_pfn) ? end_pfn : zone->end_pfn;
+        uint64_t node_end = numa_pfn_range_end(pfn);
+        if (node_end < chunk_end) chunk_end = node_end;
+        zone->present_pages += chunk_end - pfn;
+        buddy_free_range(zone, pfn, chunk_end - pfn);
+        pfn = chunk_end;
+    }
+    return end_pfn - start_pfn;
+}
+
 void pmm_init(struct limine_memmap_response *memmap, uint64_t hhdm_offset) {
     hhdm_offset_global = hhdm_offset;
     uint64_t highest_addr = 0;
 
+    spinlock_init(&pmm_lock);
+    spinlock_init(&zero_lock);
+
+    for (uint32_t node = 0; node < MAX_NUMNODES; node++) {
+        for (int id = 0; id < ZONE_COUNT; id++) {
+            zones[node][id].name = zone_names[id];
+            zones[node][id].node = node;
+            zones[node][id].start_pfn = zone_start_pfn[id];
+            zones[node][id].end_pfn = zone_end_pfn[id];
+        }
+    }
+
     // 1. Calculate total memory and find the highest physical address
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
-        
+
         // Calculate top of this region
         uint64_t top = entry->base + entry->length;
         if (top > highest_addr) {
@@ -38,136 +349,536 @@ void pmm_init(struct limine_memmap_response *memmap, uint64_t hhdm_offset) {
     }
 
     highest_page = highest_addr / PAGE_SIZE;
-    bitmap_size = (highest_page / 8) + 1;
+    bitmap_size = hbitmap_storage_size(highest_page);
 
-    // 2. Find a place to store the bitmap
-    // We need a contiguous chunk of memory large enough for the bitmap itself.
-    for (uint64_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry *entry = memmap->entries[i];
-        
-        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= bitmap_size) {
-            // Found a spot!
-            // IMPORTANT: The bitmap address is Physical, we need to access it via Virtual (HHDM)
-            bitmap = (uint8_t*)phys_to_virt(entry->base);
-            
-            // Initialize entire bitmap to 1 (Used)
-            // We will selectively free usable regions later.
-            memset(bitmap, 0xFF, bitmap_size);
-            
-            // Mark the region used by the bitmap itself as used (it's already 1, but for clarity)
-            // We don't need to do anything special here because we just set everything to 1.
+    // The bitmap and the frame database share one contiguous allocation.
+    // bitmap_size is a multiple of 8, so page_db stays naturally aligned.
+    uint64_t db_size = highest_page * sizeof(page_t);
+    uint64_t metadata_size = (bitmap_size + db_size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t metadata_phys = 0;
+    int metadata_found = 0;
+
+    // 2. Find a place to store the metadata
+    // We need a contiguous chunk of memory large enough for the bitmap and frame
+    // database. Keep it out of ZONE_DMA16 when possible: on big machines it is
+    // larger than the whole zone.
+    for (int pass = 0; pass < 2 && !metadata_found; pass++) {
+        uint64_t floor = (pass == 0) ? DMA16_END_PFN * PAGE_SIZE : 0;
+
+        for (uint64_t i = 0; i < memmap->entry_count; i++) {
+            struct limine_memmap_entry *entry = memmap->entries[i];
+            if (entry->type != LIMINE_MEMMAP_USABLE) continue;
+
+            uint64_t base = (entry->base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+            if (base < floor) base = floor;
+            uint64_t end = entry->base + entry->length;
+            if (end < base || end - base < metadata_size) continue;
+
+            metadata_phys = base;
+            metadata_found = 1;
             break;
         }
     }
 
-    if (bitmap == NULL) {
+    if (!metadata_found) {
         printk("[PMM] Critical Error: Could not allocate PMM bitmap!\n");
         for(;;) __asm__("hlt");
     }
 
-    // 3. Populate the bitmap based on the memory map
+    // IMPORTANT: The address is Physical, we need to access it via Virtual (HHDM)
+    uint8_t* metadata = (uint8_t*)phys_to_virt(metadata_phys);
+    page_db = (page_t*)(metadata + bitmap_size);
+
+    // Everything starts out used, reserved and not on any free list.
+    // Usable regions are handed to the buddy lists below.
+    hbitmap_init(&frame_map, metadata, highest_page, true);
+    memset(page_db, 0, db_size);
+    for (uint64_t pfn = 0; pfn < highest_page; pfn++) {
+        page_db[pfn].order = ORDER_NONE;
+        page_db[pfn].flags = PG_RESERVED;
+    }
+
+    // 3. Hand every USABLE region to the buddy allocator as whole aligned blocks
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
 
-        // We only care about USABLE memory. Everything else is already marked "Used" (0xFF).
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            // Iterate over pages in this region
-            for (uint64_t addr = entry->base; addr < entry->base + entry->length; addr += PAGE_SIZE) {
-                uint64_t page_idx = addr / PAGE_SIZE;
-                
-                // Ensure we don't free the memory where the bitmap ITSELF lives
-                uint64_t bitmap_phys_start = (uint64_t)bitmap - hhdm_offset_global;
-                uint64_t bitmap_phys_end = bitmap_phys_start + bitmap_size;
-
-                if (addr >= bitmap_phys_start && addr < bitmap_phys_end) {
-                    // This page holds the bitmap, keep it marked used
-                    continue;
-                }
+        if (entry->type != LIMINE_MEMMAP_USABLE) {
+            continue;
+        }
 
-                bitmap_clear(bitmap, page_idx);
-                free_memory += PAGE_SIZE;
-            }
+        uint64_t start = entry->base;
+        uint64_t end = entry->base + entry->length;
+
+        // Keep the pages holding the metadata itself marked used
+        if (metadata_phys >= start && metadata_phys < end) {
+            add_free_region(start, metadata_phys);
+            start = metadata_phys + metadata_size;
+        }
+
+        add_free_region(start, end);
+    }
+
+    printk("[PMM] Initialized. Metadata size: %llu bytes (%llu per frame). Free RAM: %llu MB\n",
+           metadata_size, (uint64_t)sizeof(page_t), pmm_get_free_memory() / 1024 / 1024);
+
+    for (uint32_t node = 0; node < numa_node_count(); node++) {
+        // Only hold frames back if the zone is big enough to spare them
+        pmm_zone_t* dma16 = &zones[node][ZONE_DMA16];
+        dma16->reserve_pages = (dma16->present_pages > DMA16_RESERVE_PAGES * 2) ? DMA16_RESERVE_PAGES : 0;
+
+        for (int id = 0; id < ZONE_COUNT; id++) {
+            if (zones[node][id].present_pages == 0) continue;
+            printk("[PMM] Node %u zone %-6s: %llu MB\n", node, zones[node][id].name,
+                   zones[node][id].present_pages * PAGE_SIZE / 1024 / 1024);
+        }
+    }
+}
+
+static inline uint64_t pcp_pop_hot(pmm_pcp_t* cache) {
+    uint64_t page = cache->pages[cache->head];
+    cache->head = (cache->head + 1) % PMM_PCP_HIGH;
+    cache->count--;
+    return page;
+}
+
+static inline uint64_t pcp_pop_cold(pmm_pcp_t* cache) {
+    cache->count--;
+    return cache->pages[(cache->head + cache->count) % PMM_PCP_HIGH];
+}
+
+static inline void pcp_push_hot(pmm_pcp_t* cache, uint64_t page) {
+    cache->head = (cache->head + PMM_PCP_HIGH - 1) % PMM_PCP_HIGH;
+    cache->pages[cache->head] = page;
+    cache->count++;
+}
+
+static inline void pcp_push_cold(pmm_pcp_t* cache, uint64_t page) {
+    cache->pages[(cache->head + cache->count) % PMM_PCP_HIGH] = page;
+    cache->count++;
+}
+
+// Move up to PMM_PCP_BATCH frames from the buddy lists to the cold end,
+// taking them from the CPU's own node first. Called with interrupts disabled.
+static void pcp_refill(pmm_pcp_t* cache, uint32_t node) {
+    spinlock_acquire(&pmm_lock);
+    for (int i = 0; i < PMM_PCP_BATCH && cache->count < PMM_PCP_HIGH; i++) {
+        int64_t pfn = buddy_alloc_zoned(0, PMM_ZONE_MASK_ANY, node);
+        if (pfn < 0) break;
+        hbitmap_set(&frame_map, pfn);
+        pcp_push_cold(cache, (uint64_t)pfn * PAGE_SIZE);
+    }
+    spinlock_release(&pmm_lock);
+    cache->stats.refills++;
+}
+
+// Return PMM_PCP_BATCH of the coldest frames to the buddy lists.
+// Called with interrupts disabled.
+static void pcp_drain(pmm_pcp_t* cache, uint32_t batch) {
+    spinlock_acquire(&pmm_lock);
+    for (uint32_t i = 0; i < batch && cache->count > 0; i++) {
+        uint64_t pfn = pcp_pop_cold(cache) / PAGE_SIZE;
+        hbitmap_clear(&frame_map, pfn);
+        buddy_free_block(pfn_to_zone(pfn), pfn, 0);
+    }
+    spinlock_release(&pmm_lock);
+    cache->stats.drains++;
+}
+
+static void* pcp_alloc(int cold) {
+    uint64_t rflags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    pmm_pcp_t* cache = &pcp[cpu];
+
+    if (cache->count == 0) {
+        cache->stats.misses++;
+        pcp_refill(cache, numa_cpu_to_node(cpu));
+        if (cache->count == 0) {
+            cpu_irq_restore(rflags);
+            return NULL; // OOM
         }
+    } else {
+        cache->stats.hits++;
+    }
+
+    uint64_t page = cold ? pcp_pop_cold(cache) : pcp_pop_hot(cache);
+    cpu_irq_restore(rflags);
+    return (void*)page;
+}
+
+static void pcp_free(void* phys_addr, int cold) {
+    uint64_t idx = (uint64_t)phys_addr / PAGE_SIZE;
+
+    if (idx >= highest_page) return; // Out of bounds
+
+    // Pages that are already on the buddy lists are double frees; ignore them
+    if (!hbitmap_test(&frame_map, idx)) return;
+
+    uint64_t rflags = cpu_irq_save();
+    pmm_pcp_t* cache = &pcp[cpu_current_id()];
+
+    if (cache->count == PMM_PCP_HIGH) {
+        pcp_drain(cache, PMM_PCP_BATCH);
+    }
+
+    if (cold) {
+        pcp_push_cold(cache, idx * PAGE_SIZE);
+    } else {
+        pcp_push_hot(cache, idx * PAGE_SIZE);
+    }
+    cache->stats.frees++;
+    cpu_irq_restore(rflags);
+}
+
+// --- Frame database ---
+
+// Free frames are counted by the zones, not here
+static inline void owner_account(uint8_t owner, int64_t pages) {
+    if (owner == PMM_OWNER_NONE) return;
+    __atomic_fetch_add(&owner_pages[owner], (uint64_t)pages, __ATOMIC_RELAXED);
+}
+
+// Frames leaving the allocator: one reference, owned by the kernel until tagged
+static void pages_claim(uint64_t pfn, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        page_t* page = &page_db[pfn + i];
+        page->refcount = 1;
+        page->flags = 0;
+        page->owner = PMM_OWNER_KERNEL;
+        page->private = 0;
+    }
+    owner_account(PMM_OWNER_KERNEL, (int64_t)count);
+}
+
+// Frames going back to the allocator
+static void pages_reset(uint64_t pfn, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        page_t* page = &page_db[pfn + i];
+        owner_account(page->owner, -1);
+        page->refcount = 0;
+        page->flags = 0;
+        page->owner = PMM_OWNER_NONE;
+        page->private = 0;
+    }
+}
+
+// Drop one reference. Returns 1 if it was the last one and the frame should be
+// freed. Frames that are reserved or already free are left alone.
+static int page_release(uint64_t pfn) {
+    if (pfn >= highest_page) return 0;
+
+    page_t* page = &page_db[pfn];
+    if ((page->flags & PG_RESERVED) || page->refcount == 0) return 0;
+    if (__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL) != 0) return 0;
+
+    pages_reset(pfn, 1);
+    return 1;
+}
+
+static void* zero_pool_pop(int want_zeroed) {
+    void* page = NULL;
+    uint64_t rflags = cpu_irq_save();
+    spinlock_acquire(&zero_lock);
+    if (zero_pool_count > 0) {
+        page = (void*)zero_pool[--zero_pool_count];
+        pages_reset((uint64_t)page / PAGE_SIZE, 1);
+        if (want_zeroed) zero_stats.hits++;
+    } else if (want_zeroed) {
+        zero_stats.misses++;
     }
-    
-    used_memory = total_memory - free_memory;
-    printk("[PMM] Initialized. Bitmap size: %llu bytes. Free RAM: %llu MB\n", 
-           bitmap_size, free_memory / 1024 / 1024);
+    spinlock_release(&zero_lock);
+    cpu_irq_restore(rflags);
+    return page;
+}
+
+// Allocate a single page.
+// A pooled frame is as good as any other when the allocator has run dry.
+static void* alloc_page(int cold) {
+    void* page = pcp_alloc(cold);
+    if (!page) page = zero_pool_pop(0);
+    if (page) pages_claim((uint64_t)page / PAGE_SIZE, 1);
+    return page;
 }
 
-// Allocate a single page
 void* pmm_alloc_page(void) {
-    // Simple first-fit search
-    // Optimization TODO: Keep track of last_free_index to speed up search
-    for (uint64_t i = 0; i < highest_page; i++) {
-        if (!bitmap_test(bitmap, i)) {
-            bitmap_set(bitmap, i);
-            free_memory -= PAGE_SIZE;
-            used_memory += PAGE_SIZE;
-            return (void*)(i * PAGE_SIZE);
+    return alloc_page(0);
+}
+
+void* pmm_alloc_page_cold(void) {
+    return alloc_page(1);
+}
+
+// --- Pre-zeroed pages ---
+
+static inline void zero_frame(uint64_t phys) {
+    void* dest = phys_to_virt(phys);
+    uint64_t words = PAGE_SIZE / sizeof(uint64_t);
+    __asm__ volatile("rep stosq" : "+D"(dest), "+c"(words) : "a"(0ULL) : "memory");
+}
+
+void* pmm_try_alloc_zeroed_page(void) {
+    void* page = zero_pool_pop(1);
+    if (page) pages_claim((uint64_t)page / PAGE_SIZE, 1);
+    return page;
+}
+
+void* pmm_alloc_zeroed_page(void) {
+    void* page = zero_pool_pop(1);
+    if (!page) {
+        page = pcp_alloc(0);
+        if (!page) return NULL;
+        zero_frame((uint64_t)page);
+    }
+    pages_claim((uint64_t)page / PAGE_SIZE, 1);
+    return page;
+}
+
+uint32_t pmm_zero_pool_refill(uint32_t max_pages) {
+    uint32_t done = 0;
+
+    while (done < max_pages && zero_pool_count < PMM_ZERO_POOL_SIZE) {
+        // Cold frames: clearing them pulls them into the cache anyway, and the
+        // warm ones are better left for callers that will overwrite them
+        void* page = pcp_alloc(1);
+        if (!page) break;
+        zero_frame((uint64_t)page);
+
+        uint64_t rflags = cpu_irq_save();
+        spinlock_acquire(&zero_lock);
+        int pooled = zero_pool_count < PMM_ZERO_POOL_SIZE;
+        if (pooled) {
+            page_t* meta = &page_db[(uint64_t)page / PAGE_SIZE];
+            meta->owner = PMM_OWNER_ZERO_POOL;
+            meta->flags = PG_ZEROED;
+            owner_account(PMM_OWNER_ZERO_POOL, 1);
+            zero_pool[zero_pool_count++] = (uint64_t)page;
+            zero_stats.zeroed++;
+        }
+        spinlock_release(&zero_lock);
+        cpu_irq_restore(rflags);
+
+        if (!pooled) {
+            pcp_free(page, 1);
+            break;
         }
+        done++;
     }
-    return NULL; // OOM
+    return done;
 }
 
-// Free a single page
+// Free a single page (drop one reference to it)
 void pmm_free_page(void* phys_addr) {
-    uint64_t addr = (uint64_t)phys_addr;
-    uint64_t idx = addr / PAGE_SIZE;
-    
-    if (idx >= highest_page) return; // Out of bounds
-    
-    if (bitmap_test(bitmap, idx)) {
-        bitmap_clear(bitmap, idx);
-        free_memory += PAGE_SIZE;
-        used_memory -= PAGE_SIZE;
+    if (page_release((uint64_t)phys_addr / PAGE_SIZE)) {
+        pcp_free(phys_addr, 0);
     }
 }
 
-// Allocate contiguous pages (Crucial for GUI/DMA)
-void* pmm_alloc_pages(size_t count) {
-    if (count == 0) return NULL;
-
-    for (uint64_t i = 0; i < highest_page; i++) {
-        // Check if the first page is free
-        if (!bitmap_test(bitmap, i)) {
-            // Check if the next 'count' pages are also free
-            int found = 1;
-            for (size_t j = 1; j < count; j++) {
-                if (i + j >= highest_page || bitmap_test(bitmap, i + j)) {
-                    found = 0;
-                    i += j; // Skip ahead
-                    break;
-                }
-            }
+void pmm_free_page_cold(void* phys_addr) {
+    if (page_release((uint64_t)phys_addr / PAGE_SIZE)) {
+        pcp_free(phys_addr, 1);
+    }
+}
 
-            if (found) {
-                // Mark all as used
-                for (size_t j = 0; j < count; j++) {
-                    bitmap_set(bitmap, i + j);
-                }
-                free_memory -= (count * PAGE_SIZE);
-                used_memory += (count * PAGE_SIZE);
-                return (void*)(i * PAGE_SIZE);
-            }
+static void* alloc_pages(size_t count, uint32_t zone_mask, uint32_t node) {
+    if (count == 0 || !(zone_mask & PMM_ZONE_MASK_ANY)) return NULL;
+
+    int64_t pfn = -1;
+
+    spinlock_acquire(&pmm_lock);
+
+    if (count <= (1ULL << PMM_MAX_ORDER)) {
+        // Round up to a power of two, then return the unused tail right away.
+        // The result is aligned to the rounded-up block size.
+        unsigned int order = order_for_count(count);
+        pfn = buddy_alloc_zoned(order, zone_mask, node);
+        if (pfn < 0) {
+            spinlock_release(&pmm_lock);
+            return NULL;
+        }
+
+        if ((1ULL << order) > count) {
+            buddy_free_range(pfn_to_zone(pfn), pfn + count, (1ULL << order) - count);
+        }
+    } else {
+        // Larger than any buddy block: search the frame map for a free run
+        // aligned like the largest block. Fully used 4096-frame groups are
+        // skipped in one compare.
+        pfn = frame_map_find_zoned(count, 1ULL << PMM_MAX_ORDER, zone_mask, node);
+        if (pfn < 0) {
+            spinlock_release(&pmm_lock);
+            return NULL;
         }
+
+        buddy_claim_range(pfn, count);
     }
-    return NULL;
+
+    hbitmap_set_range(&frame_map, pfn, count);
+    spinlock_release(&pmm_lock);
+
+    pages_claim(pfn, count);
+    return (void*)(pfn * PAGE_SIZE);
+}
+
+// Allocate contiguous pages (Crucial for GUI/DMA)
+void* pmm_alloc_pages(size_t count) {
+    return alloc_pages(count, PMM_ZONE_MASK_ANY, numa_local_node());
+}
+
+void* pmm_alloc_pages_zone(size_t count, uint32_t zone_mask) {
+    return alloc_pages(count, zone_mask, numa_local_node());
+}
+
+void* pmm_alloc_pages_node(size_t count, uint32_t node) {
+    return alloc_pages(count, PMM_ZONE_MASK_ANY, node);
 }
 
 void pmm_free_pages(void* phys_addr, size_t count) {
     uint64_t start_addr = (uint64_t)phys_addr;
     uint64_t start_idx = start_addr / PAGE_SIZE;
 
+    if (start_idx >= highest_page) return;
+    if (start_idx + count > highest_page) {
+        count = highest_page - start_idx;
+    }
+
+    // Putting a free or reserved frame on the buddy lists would corrupt them
     for (size_t i = 0; i < count; i++) {
-        if (start_idx + i < highest_page) {
-            bitmap_clear(bitmap, start_idx + i);
+        page_t* page = &page_db[start_idx + i];
+        if ((page->flags & PG_RESERVED) || page->refcount == 0) {
+            printk("[PMM] Bad free of frame 0x%llx (%s)\n", (start_idx + i) * PAGE_SIZE,
+                   (page->flags & PG_RESERVED) ? "reserved" : "not allocated");
+            panic("PMM: Freeing frames that are not allocated");
         }
     }
-    free_memory += (count * PAGE_SIZE);
-    used_memory -= (count * PAGE_SIZE);
+
+    pages_reset(start_idx, count);
+
+    spinlock_acquire(&pmm_lock);
+    hbitmap_clear_range(&frame_map, start_idx, count);
+    buddy_free_range(pfn_to_zone(start_idx), start_idx, count);
+    spinlock_release(&pmm_lock);
+}
+
+// Frames parked in the per-CPU caches and the zero pool are free for accounting purposes
+uint64_t pmm_get_free_memory(void) {
+    uint64_t pages = 0;
+    for (uint32_t node = 0; node < MAX_NUMNODES; node++) {
+        for (int id = 0; id < ZONE_COUNT; id++) {
+            pages += zones[node][id].free_pages;
+        }
+    }
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pages += pcp[cpu].count;
+    }
+    pages += zero_pool_count;
+    return pages * PAGE_SIZE;
+}
+
+uint64_t pmm_reclaim_range(uint64_t base, uint64_t length) {
+    spinlock_acquire(&pmm_lock);
+    uint64_t pages = add_free_region(base, base + length);
+    total_memory += pages * PAGE_SIZE;
+    reclaimed_memory += pages * PAGE_SIZE;
+    spinlock_release(&pmm_lock);
+    return pages * PAGE_SIZE;
+}
+
+page_t* pmm_phys_to_page(uint64_t phys) {
+    uint64_t pfn = phys / PAGE_SIZE;
+    return (pfn < highest_page) ? &page_db[pfn] : NULL;
 }
 
-uint64_t pmm_get_free_memory(void) { return free_memory; }
-uint64_t pmm_get_used_memory(void) { return used_memory; }
-uint64_t pmm_get_total_memory(void) { return total_memory; }
\ No newline at end of file
+uint64_t pmm_page_to_phys(page_t* page) {
+    return (uint64_t)(page - page_db) * PAGE_SIZE;
+}
+
+void pmm_page_get(void* phys_addr) {
+    page_t* page = pmm_phys_to_page((uint64_t)phys_addr);
+    if (!page || page->refcount == 0) return;
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+uint32_t pmm_page_refcount(void* phys_addr) {
+    page_t* page = pmm_phys_to_page((uint64_t)phys_addr);
+    return page ? page->refcount : 0;
+}
+
+void pmm_set_owner(void* phys_addr, size_t count, pmm_owner_t owner) {
+    uint64_t pfn = (uint64_t)phys_addr / PAGE_SIZE;
+    if (owner >= PMM_OWNER_COUNT || pfn + count > highest_page) return;
+
+    for (size_t i = 0; i < count; i++) {
+        page_t* page = &page_db[pfn + i];
+        if (page->refcount == 0) continue;   // Not allocated
+        owner_account(page->owner, -1);
+        owner_account(owner, 1);
+        page->owner = owner;
+    }
+}
+
+uint64_t pmm_get_owner_pages(pmm_owner_t owner) {
+    return (owner < PMM_OWNER_COUNT) ? owner_pages[owner] : 0;
+}
+
+const char* pmm_owner_name(pmm_owner_t owner) {
+    static const char* const names[PMM_OWNER_COUNT] = {
+        [PMM_OWNER_NONE]      = "free",
+        [PMM_OWNER_KERNEL]    = "kernel",
+        [PMM_OWNER_PAGETABLE] = "pagetable",
+        [PMM_OWNER_HEAP]      = "heap",
+        [PMM_OWNER_STACK]     = "stack",
+        [PMM_OWNER_ZERO_POOL] = "zeropool",
+        [PMM_OWNER_SLAB]      = "slab",
+        [PMM_OWNER_ARENA]     = "arena",
+    };
+    return (owner < PMM_OWNER_COUNT) ? names[owner] : "?";
+}
+
+uint64_t pmm_get_reclaimed_memory(void) { return reclaimed_memory; }
+uint64_t pmm_get_used_memory(void) { return total_memory - pmm_get_free_memory(); }
+uint64_t pmm_get_total_memory(void) { return total_memory; }
+
+void pmm_get_pcp_stats(uint32_t cpu, pmm_pcp_stats_t* out) {
+    if (cpu >= MAX_CPUS) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    *out = pcp[cpu].stats;
+    out->cached = pcp[cpu].count;
+}
+
+void pmm_get_zero_stats(pmm_zero_stats_t* out) {
+    *out = zero_stats;
+    out->pooled = zero_pool_count;
+}
+
+uint64_t pmm_get_free_blocks(pmm_zone_id_t zone, unsigned int order) {
+    if (zone >= ZONE_COUNT || order > PMM_MAX_ORDER) return 0;
+    uint64_t blocks = 0;
+    for (uint32_t node = 0; node < MAX_NUMNODES; node++) {
+        blocks += zones[node][zone].free_blocks[order];
+    }
+    return blocks;
+}
+
+// Zone totals across all nodes
+void pmm_get_zone_stats(pmm_zone_id_t zone, pmm_zone_stats_t* out) {
+    memset(out, 0, sizeof(*out));
+    if (zone >= ZONE_COUNT) return;
+    out->name = zone_names[zone];
+    out->start_pfn = zone_start_pfn[zone];
+    out->end_pfn = zone_end_pfn[zone];
+    for (uint32_t node = 0; node < MAX_NUMNODES; node++) {
+        out->present_pages += zones[node][zone].present_pages;
+        out->free_pages += zones[node][zone].free_pages;
+        out->reserve_pages += zones[node][zone].reserve_pages;
+    }
+}
+
+void pmm_get_node_stats(uint32_t node, pmm_node_stats_t* out) {
+    memset(out, 0, sizeof(*out));
+    if (node >= MAX_NUMNODES) return;
+    for (int id = 0; id < ZONE_COUNT; id++) {
+        out->present_pages += zones[node][id].present_pages;
+        out->free_pages += zones[node][id].free_pages;
+    }
+}
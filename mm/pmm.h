@@ -7,6 +7,92 @@
 
 #define PAGE_SIZE 4096
 
+// Largest buddy block is 2^PMM_MAX_ORDER pages (4 MiB)
+#define PMM_MAX_ORDER 10
+
+// Per-CPU page cache sizing: a cache holds at most PMM_PCP_HIGH frames and
+// moves PMM_PCP_BATCH frames at a time to or from the buddy allocator.
+#define PMM_PCP_HIGH  64
+#define PMM_PCP_BATCH 16
+
+// Frames kept cleared ahead of time by pmm_zero_pool_refill()
+#define PMM_ZERO_POOL_SIZE 256
+
+// Physical memory zones, lowest first
+typedef enum {
+    ZONE_DMA16,     // Below 16 MiB: legacy ISA DMA
+    ZONE_DMA32,     // Below 4 GiB: 32-bit-only PCI bus masters
+    ZONE_NORMAL,    // Everything above 4 GiB
+    ZONE_COUNT
+} pmm_zone_id_t;
+
+// Zone masks for pmm_alloc_pages_zone(). Allocations try the highest allowed
+// zone first so the scarce low zones are preserved.
+#define ZONE_MASK(zone)         (1u << (zone))
+#define PMM_ZONE_MASK_DMA16     ZONE_MASK(ZONE_DMA16)
+#define PMM_ZONE_MASK_DMA32     (ZONE_MASK(ZONE_DMA16) | ZONE_MASK(ZONE_DMA32))
+#define PMM_ZONE_MASK_ANY       (ZONE_MASK(ZONE_DMA16) | ZONE_MASK(ZONE_DMA32) | ZONE_MASK(ZONE_NORMAL))
+
+typedef struct {
+    const char* name;
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint64_t present_pages;
+    uint64_t free_pages;        // On the buddy lists (per-CPU caches not included)
+    uint64_t reserve_pages;
+} pmm_zone_stats_t;
+
+typedef struct {
+    uint64_t present_pages;
+    uint64_t free_pages;        // On the buddy lists (per-CPU caches not included)
+} pmm_node_stats_t;
+
+// Who an allocated frame belongs to, for per-subsystem accounting
+typedef enum {
+    PMM_OWNER_NONE = 0,         // Free
+    PMM_OWNER_KERNEL,           // Allocated, not tagged by the caller
+    PMM_OWNER_PAGETABLE,
+    PMM_OWNER_HEAP,
+    PMM_OWNER_STACK,
+    PMM_OWNER_ZERO_POOL,
+    PMM_OWNER_SLAB,
+    PMM_OWNER_ARENA,
+    PMM_OWNER_COUNT
+} pmm_owner_t;
+
+// page_t.flags
+#define PG_RESERVED  (1 << 0)   // Not managed by the PMM (firmware, MMIO, PMM metadata)
+#define PG_ZEROED    (1 << 1)   // Known to be all zeroes (sitting in the zero pool)
+#define PG_COW       (1 << 2)   // Shared read-only; copy before writing
+
+#define PAGE_ORDER_NONE 0xFF
+
+// Frame database entry, one per physical frame, indexed by PFN.
+// 16 bytes per 4 KiB frame (~0.4% of RAM), allocated next to the frame map.
+typedef struct {
+    uint32_t refcount;          // Users of the frame; 0 when free
+    uint16_t flags;             // PG_*
+    uint8_t order;              // Buddy order if the frame heads a free block, else PAGE_ORDER_NONE
+    uint8_t owner;              // pmm_owner_t
+    uint64_t private;           // For the owner's use (cleared on allocation)
+} page_t;
+
+typedef struct {
+    uint64_t hits;      // Single-page allocations served from the cache
+    uint64_t misses;    // Allocations that found the cache empty
+    uint64_t frees;     // Single-page frees absorbed by the cache
+    uint64_t refills;   // Batches pulled from the buddy allocator
+    uint64_t drains;    // Batches returned to the buddy allocator
+    uint64_t cached;    // Frames currently held
+} pmm_pcp_stats_t;
+
+typedef struct {
+    uint64_t zeroed;            // Frames cleared off the allocation path
+    uint64_t hits;              // Zeroed allocations served from the pool
+    uint64_t misses;            // Zeroed allocations that found the pool empty
+    uint64_t pooled;            // Frames currently in the pool
+} pmm_zero_stats_t;
+
 // Initialize PMM with the memory map and the HHDM offset
 void pmm_init(struct limine_memmap_response *memmap, uint64_t hhdm_offset);
 
@@ -14,19 +100,83 @@ void pmm_init(struct limine_memmap_response *memmap, uint64_t hhdm_offset);
 // Returns NULL (0) if out of memory.
 void* pmm_alloc_page(void);
 
-// Free a physical page.
+// Drop a reference to a physical page; it is freed when the last one goes.
 void pmm_free_page(void* phys_addr);
 
+// Cold variants: take from / return to the cold end of the per-CPU cache.
+// Use them for frames the CPU will not touch soon (e.g. DMA buffers).
+void* pmm_alloc_page_cold(void);
+void pmm_free_page_cold(void* phys_addr);
+
+// Allocate a page that reads as all zeroes. Served from the pool of frames
+// cleared at idle time; when the pool is empty the page is cleared inline.
+void* pmm_alloc_zeroed_page(void);
+
+// Like pmm_alloc_zeroed_page(), but returns NULL instead of clearing inline
+// when the pool is empty, for callers that don't strictly need zeroes.
+void* pmm_try_alloc_zeroed_page(void);
+
+// Clear up to 'max_pages' free frames into the zero pool.
+// Meant for the idle loop; returns the number of frames added.
+uint32_t pmm_zero_pool_refill(uint32_t max_pages);
+
 // Allocate 'count' contiguous pages. Returns PHYSICAL address of the first page.
-// Crucial for DMA and Framebuffers.
+// Crucial for DMA and Framebuffers. The run is aligned to 'count' rounded up
+// to a power of two, at most to 2^PMM_MAX_ORDER pages.
 void* pmm_alloc_pages(size_t count);
 
-// Free 'count' contiguous pages.
+// Allocate 'count' contiguous pages from one of the zones in 'zone_mask'.
+// Use PMM_ZONE_MASK_DMA16/DMA32 for devices with addressing limits.
+void* pmm_alloc_pages_zone(size_t count, uint32_t zone_mask);
+
+// Allocate 'count' contiguous pages, preferring NUMA node 'node'.
+// The other allocation calls prefer the node of the calling CPU.
+void* pmm_alloc_pages_node(size_t count, uint32_t node);
+
+// Free 'count' contiguous pages. Unlike pmm_free_page() this ignores
+// reference counts; don't use it on frames that may be shared.
 void pmm_free_pages(void* phys_addr, size_t count);
 
+// Frame database access. Allocated frames start with one reference, owned
+// by PMM_OWNER_KERNEL until pmm_set_owner() tags them.
+page_t* pmm_phys_to_page(uint64_t phys);
+uint64_t pmm_page_to_phys(page_t* page);
+
+// Take an extra reference to an allocated page (e.g. to share it)
+void pmm_page_get(void* phys_addr);
+uint32_t pmm_page_refcount(void* phys_addr);
+
+// Tag 'count' allocated frames starting at 'phys_addr' as belonging to 'owner'
+void pmm_set_owner(void* phys_addr, size_t count, pmm_owner_t owner);
+
+// Allocated frames per owner
+uint64_t pmm_get_owner_pages(pmm_owner_t owner);
+const char* pmm_owner_name(pmm_owner_t owner);
+
 // Get memory statistics
 uint64_t pmm_get_free_memory(void);
 uint64_t pmm_get_used_memory(void);
 uint64_t pmm_get_total_memory(void);
 
+// Return a region that was in use since boot (e.g. bootloader-reclaimable
+// memory) to the allocator. The caller guarantees nothing references it.
+// Returns the number of bytes added.
+uint64_t pmm_reclaim_range(uint64_t base, uint64_t length);
+
+// Bytes added by pmm_reclaim_range() so far
+uint64_t pmm_get_reclaimed_memory(void);
+
+// Number of free buddy blocks of the given order in a zone
+uint64_t pmm_get_free_blocks(pmm_zone_id_t zone, unsigned int order);
+
+// Zone boundaries and counters
+void pmm_get_zone_stats(pmm_zone_id_t zone, pmm_zone_stats_t* out);
+
+// Per-NUMA-node counters
+void pmm_get_node_stats(uint32_t node, pmm_node_stats_t* out);
+
+// Per-CPU page cache counters
+void pmm_get_pcp_stats(uint32_t cpu, pmm_pcp_stats_t* out);
+void pmm_get_zero_stats(pmm_zero_stats_t* out);
+
 #endif
\ No newline at end of file
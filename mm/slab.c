@@ -0,0 +1,241 @@
+#include "slab.h"
+#include "pmm.h"
+#include "../lib/string.h"
+#include "../lib/printk.h"
+#include "../lib/panic.h"
+
+#define CACHE_LINE          64
+#define SLAB_MIN_OBJECTS    8   // Grow slabs until at least this many fit...
+#define SLAB_MAX_PAGES      8   // ...or they reach this size
+#define SLAB_EMPTY_MAX      1   // Empty slabs a cache keeps for reuse
+
+extern uint64_t hhdm_offset;
+
+// Header at the start of every slab's first frame. Each frame of the slab
+// points back to it through page_t.private.
+struct slab {
+    slab_t* next;
+    slab_t* prev;
+    kmem_cache_t* cache;
+    void* free;                 // First free object
+    uint32_t inuse;
+    uint32_t colour;
+    uint8_t* objects;
+};
+
+// Caches are objects too: this one holds every kmem_cache_t
+static kmem_cache_t cache_cache;
+static kmem_cache_t* cache_list = NULL;
+static spinlock_t cache_list_lock;
+
+static inline size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+// A free object keeps its next pointer at 'free_offset': past the object
+// when there is a constructor, so the constructed state survives
+static inline void** free_ptr(kmem_cache_t* cache, void* obj) {
+    return (void**)((uint8_t*)obj + cache->free_offset);
+}
+
+static void list_add(slab_t** head, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void list_del(slab_t** head, slab_t* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *head = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static void cache_setup(kmem_cache_t* cache, const char* name, size_t size, size_t align,
+                        void (*ctor)(void*)) {
+    memset(cache, 0, sizeof(*cache));
+    strncpy(cache->name, name, SLAB_NAME_LEN - 1);
+    cache->name[SLAB_NAME_LEN - 1] = '\0';
+
+    if (align < sizeof(void*)) align = sizeof(void*);
+    if (size < sizeof(void*)) size = sizeof(void*);
+
+    cache->object_size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->free_offset = ctor ? align_up(size, sizeof(void*)) : 0;
+    cache->stride = align_up(ctor ? cache->free_offset + sizeof(void*) : size, align);
+
+    size_t header = align_up(sizeof(slab_t), align);
+    uint32_t pages = 1;
+    while (pages < SLAB_MAX_PAGES &&
+           (pages * PAGE_SIZE - header) / cache->stride < SLAB_MIN_OBJECTS) {
+        pages *= 2;
+    }
+    if (pages * PAGE_SIZE - header < cache->stride) {
+        panic("slab: Object too large for a slab");
+    }
+
+    cache->slab_pages = pages;
+    cache->objects_per_slab = (pages * PAGE_SIZE - header) / cache->stride;
+
+    size_t slack = pages * PAGE_SIZE - header - cache->objects_per_slab * cache->stride;
+    cache->colour_step = align_up(CACHE_LINE, align);
+    cache->colour_count = slack / cache->colour_step + 1;
+
+    spinlock_init(&cache->lock);
+}
+
+static void cache_register(kmem_cache_t* cache) {
+    spinlock_acquire(&cache_list_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    spinlock_release(&cache_list_lock);
+}
+
+// New slab with every object free (and constructed). Lock held.
+static slab_t* cache_grow(kmem_cache_t* cache) {
+    void* phys = (cache->slab_pages > 1) ? pmm_alloc_pages(cache->slab_pages) : pmm_alloc_page();
+    if (!phys) return NULL;
+    pmm_set_owner(phys, cache->slab_pages, PMM_OWNER_SLAB);
+
+    slab_t* slab = (slab_t*)((uint64_t)phys + hhdm_offset);
+    for (uint32_t i = 0; i < cache->slab_pages; i++) {
+        pmm_phys_to_page((uint64_t)phys + i * PAGE_SIZE)->private = (uint64_t)slab;
+    }
+
+    slab->next = slab->prev = NULL;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->colour = cache->colour_next;
+    cache->colour_next = (cache->colour_next + 1) % cache->colour_count;
+    slab->objects = (uint8_t*)slab + align_up(sizeof(slab_t), cache->align) +
+                    slab->colour * cache->colour_step;
+
+    // Chain the objects in address order
+    slab->free = NULL;
+    for (uint32_t i = cache->objects_per_slab; i-- > 0;) {
+        void* obj = slab->objects + i * cache->stride;
+        if (cache->ctor) cache->ctor(obj);
+        *free_ptr(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    cache->slab_count++;
+    cache->total_objects += cache->objects_per_slab;
+    cache->grows++;
+    return slab;
+}
+
+// Give an empty slab's frames back. Lock held, slab on no list.
+static void slab_release(kmem_cache_t* cache, slab_t* slab) {
+    cache->slab_count--;
+    cache->total_objects -= cache->objects_per_slab;
+    cache->reaps++;
+    pmm_free_pages((void*)((uint64_t)slab - hhdm_offset), cache->slab_pages);
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    // The cache of caches is set up on first use
+    spinlock_acquire(&cache_list_lock);
+    int first = (cache_cache.objects_per_slab == 0);
+    if (first) {
+        cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), CACHE_LINE, NULL);
+    }
+    spinlock_release(&cache_list_lock);
+    if (first) {
+        cache_register(&cache_cache);
+    }
+
+    kmem_cache_t* cache = (kmem_cache_t*)kmem_cache_alloc(&cache_cache);
+    if (!cache) return NULL;
+
+    cache_setup(cache, name, size, align, ctor);
+    cache_register(cache);
+    return cache;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    spinlock_acquire(&cache->lock);
+
+    slab_t* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            list_del(&cache->empty, slab);
+            cache->empty_count--;
+        } else {
+            slab = cache_grow(cache);
+            if (!slab) {
+                spinlock_release(&cache->lock);
+                return NULL;
+            }
+        }
+        list_add(&cache->partial, slab);
+    }
+
+    void* obj = slab->free;
+    slab->free = *free_ptr(cache, obj);
+    if (++slab->inuse == cache->objects_per_slab) {
+        list_del(&cache->partial, slab);
+        list_add(&cache->full, slab);
+    }
+
+    cache->active_objects++;
+    cache->allocs++;
+    spinlock_release(&cache->lock);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!obj) return;
+
+    page_t* page = pmm_phys_to_page((uint64_t)obj - hhdm_offset);
+    slab_t* slab = page ? (slab_t*)page->private : NULL;
+    if (!slab || page->owner != PMM_OWNER_SLAB || slab->cache != cache) {
+        panic("slab: Object freed to the wrong cache");
+    }
+
+    spinlock_acquire(&cache->lock);
+
+    *free_ptr(cache, obj) = slab->free;
+    slab->free = obj;
+
+    if (slab->inuse-- == cache->objects_per_slab) {
+        list_del(&cache->full, slab);
+        list_add(&cache->partial, slab);
+    }
+    if (slab->inuse == 0) {
+        list_del(&cache->partial, slab);
+        if (cache->empty_count < SLAB_EMPTY_MAX) {
+            list_add(&cache->empty, slab);
+            cache->empty_count++;
+        } else {
+            slab_release(cache, slab);
+        }
+    }
+
+    cache->active_objects--;
+    cache->frees++;
+    spinlock_release(&cache->lock);
+}
+
+size_t kmem_cache_shrink(kmem_cache_t* cache) {
+    size_t frames = 0;
+
+    spinlock_acquire(&cache->lock);
+    while (cache->empty) {
+        slab_t* slab = cache->empty;
+        list_del(&cache->empty, slab);
+        cache->empty_count--;
+        slab_release(cache, slab);
+        frames += cache->slab_pages;
+    }
+    spinlock_release(&cache->lock);
+    return frames;
+}
+
+kmem_cache_t* kmem_cache_list(void) {
+    return cache_list;
+}
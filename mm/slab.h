@@ -0,0 +1,66 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../lib/spinlock.h"
+
+// Object caches for fixed-size kernel objects. Each cache carves slabs
+// (runs of 1-8 contiguous frames, reached through the HHDM) into equal
+// objects, with no per-object header. Slabs sit on a partial, full or empty
+// list; allocation prefers partial slabs so empty ones can be given back.
+// Successive slabs start their objects at different cache-line offsets
+// ("colours") so the same object in different slabs does not always land
+// in the same cache set.
+
+#define SLAB_NAME_LEN   16
+
+typedef struct slab slab_t;
+
+typedef struct kmem_cache {
+    char name[SLAB_NAME_LEN];
+    size_t object_size;         // Size asked for
+    size_t stride;              // Distance between objects
+    size_t align;
+    size_t free_offset;         // Where a free object keeps its next pointer
+    void (*ctor)(void*);        // Run once per object when its slab is created
+
+    uint32_t slab_pages;        // Frames per slab
+    uint32_t objects_per_slab;
+    uint32_t colour_count;      // Distinct colours that fit in the slack
+    uint32_t colour_step;       // Bytes between colours
+    uint32_t colour_next;
+
+    slab_t* partial;
+    slab_t* full;
+    slab_t* empty;
+    uint32_t empty_count;
+
+    // Statistics
+    uint64_t active_objects;
+    uint64_t total_objects;
+    uint64_t slab_count;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t grows;             // Slabs created
+    uint64_t reaps;             // Empty slabs given back
+
+    spinlock_t lock;
+    struct kmem_cache* next;    // All caches, for slabinfo
+} kmem_cache_t;
+
+// Make a cache of 'size'-byte objects aligned to 'align' (0 = 8 bytes).
+// 'ctor' may be NULL. With a constructor, freed objects must be handed
+// back in their constructed state; they are not constructed again.
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*));
+
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// Give every empty slab back to the PMM. Returns the frames freed.
+size_t kmem_cache_shrink(kmem_cache_t* cache);
+
+// First cache in the list of all caches (follow ->next)
+kmem_cache_t* kmem_cache_list(void);
+
+#endif
@@ -0,0 +1,275 @@
+#include "vmalloc.h"
+#include "vmm.h"
+#include "../lib/bitmap.h"
+#include "../lib/spinlock.h"
+#include "../lib/printk.h"
+#include "../lib/panic.h"
+
+#define VMALLOC_PAGES   (VMALLOC_SIZE / PAGE_SIZE)
+#define LARGE_PAGES     512     // 4KB pages per 2MB page
+#define GUARD_PAGES     1
+
+extern uint64_t hhdm_offset;
+
+// One bit per page of the range. 'used_map' covers areas and their guard
+// pages; 'end_map' marks the last mapped page of each area, which is how
+// vfree() finds an area's length without keeping a record of it.
+static hbitmap_t used_map;
+static hbitmap_t end_map;
+static spinlock_t vmalloc_lock;
+static vmalloc_stats_t stats;
+
+static inline uint64_t page_to_va(uint64_t page) {
+    return VMALLOC_START + page * PAGE_SIZE;
+}
+
+static inline uint64_t va_to_page(uint64_t va) {
+    return (va - VMALLOC_START) / PAGE_SIZE;
+}
+
+void vmalloc_init(void) {
+    size_t bytes = hbitmap_storage_size(VMALLOC_PAGES);
+    size_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    void* storage = pmm_alloc_pages(2 * pages);
+    if (!storage) {
+        panic("vmalloc: Cannot allocate the range bitmaps");
+    }
+    pmm_set_owner(storage, 2 * pages, PMM_OWNER_KERNEL);
+
+    uint8_t* base = (uint8_t*)((uint64_t)storage + hhdm_offset);
+    hbitmap_init(&used_map, base, VMALLOC_PAGES, false);
+    hbitmap_init(&end_map, base + pages * PAGE_SIZE, VMALLOC_PAGES, false);
+    spinlock_init(&vmalloc_lock);
+
+    printk("[VMALLOC] Range 0x%llx - 0x%llx (%llu MB)\n", (uint64_t)VMALLOC_START,
+           (uint64_t)VMALLOC_START + VMALLOC_SIZE, (uint64_t)(VMALLOC_SIZE >> 20));
+}
+
+// First run of 'count' free pages whose mapped part (after the guard)
+// starts 'phase' pages into an 'align'-page block. Lock held.
+static uint64_t find_area(uint64_t count, uint64_t align, uint64_t phase) {
+    uint64_t start = 0;
+
+    for (;;) {
+        uint64_t first = hbitmap_find_next_zero_range(&used_map, start, count);
+        if (first == HBITMAP_NOT_FOUND || align <= 1) {
+            return first;
+        }
+
+        uint64_t mapped = first + GUARD_PAGES;
+        uint64_t candidate = mapped + (phase + align - mapped % align) % align - GUARD_PAGES;
+        if (candidate + count > VMALLOC_PAGES) {
+            return HBITMAP_NOT_FOUND;
+        }
+
+        uint64_t used = hbitmap_find_next_set(&used_map, candidate);
+        if (used >= candidate + count) {
+            return candidate;
+        }
+        start = used;
+    }
+}
+
+// Reserve room for 'pages' mapped pages plus the guard. Large areas are
+// placed to match 'phase' (the physical offset in a 2MB page, in pages)
+// so vmm_map_range() can use 2MB pages. Returns the first mapped address.
+static uint64_t area_alloc(uint64_t pages, uint64_t phase) {
+    uint64_t count = pages + GUARD_PAGES;
+    uint64_t first = HBITMAP_NOT_FOUND;
+    int aligned = 0;
+
+    spinlock_acquire(&vmalloc_lock);
+    if (pages >= LARGE_PAGES) {
+        first = find_area(count, LARGE_PAGES, phase);
+        aligned = (first != HBITMAP_NOT_FOUND);
+    }
+    if (first == HBITMAP_NOT_FOUND) {
+        first = find_area(count, 1, 0);
+    }
+    if (first == HBITMAP_NOT_FOUND) {
+        stats.failures++;
+        spinlock_release(&vmalloc_lock);
+        return 0;
+    }
+
+    hbitmap_set_range(&used_map, first, count);
+    hbitmap_set(&end_map, first + count - 1);
+    stats.areas++;
+    if (aligned) stats.large_aligned++;
+    spinlock_release(&vmalloc_lock);
+
+    return page_to_va(first + GUARD_PAGES);
+}
+
+// Number of mapped pages in the area starting at 'va'
+static uint64_t area_pages(uint64_t va) {
+    if (va < VMALLOC_START || va >= VMALLOC_START + VMALLOC_SIZE || (va & (PAGE_SIZE - 1))) {
+        panic("vmalloc: Address is not an area start");
+    }
+    uint64_t page = va_to_page(va);
+
+    spinlock_acquire(&vmalloc_lock);
+    int used = hbitmap_test(&used_map, page);
+    uint64_t end = hbitmap_find_next_set(&end_map, page);
+    spinlock_release(&vmalloc_lock);
+
+    if (!used || end >= VMALLOC_PAGES) {
+        panic("vmalloc: Address is not an area start");
+    }
+    return end - page + 1;
+}
+
+static void area_free(uint64_t va, uint64_t pages) {
+    uint64_t page = va_to_page(va);
+
+    spinlock_acquire(&vmalloc_lock);
+    hbitmap_clear(&end_map, page + pages - 1);
+    hbitmap_clear_range(&used_map, page - GUARD_PAGES, pages + GUARD_PAGES);
+    stats.areas--;
+    spinlock_release(&vmalloc_lock);
+}
+
+// Kept in the first frame of each contiguous run while an area is torn down
+typedef struct {
+    uint64_t next;      // Physical address of the next run, 0 at the end
+    uint64_t count;
+} run_link_t;
+
+// Unmap 'pages' pages at 'va' and free the frames behind them. The frames
+// are looked up first and chained through themselves, one link per
+// contiguous run, so a single unmap (which never has to split a 2MB leaf)
+// and a single flush come before any frame is freed.
+static void unmap_and_free(uint64_t va, uint64_t pages) {
+    uint64_t* pml4 = vmm_get_kernel_pml4();
+    uint64_t head = 0;
+    run_link_t* last = NULL;
+
+    for (uint64_t i = 0; i < pages;) {
+        uint64_t start = vmm_virt_to_phys(pml4, va + i * PAGE_SIZE);
+        uint64_t count = 1;
+        while (i + count < pages &&
+               vmm_virt_to_phys(pml4, va + (i + count) * PAGE_SIZE) == start + count * PAGE_SIZE) {
+            count++;
+        }
+        i += count;
+        if (!start) continue;
+
+        run_link_t* link = (run_link_t*)(start + hhdm_offset);
+        link->next = 0;
+        link->count = count;
+        if (last) {
+            last->next = start;
+        } else {
+            head = start;
+        }
+        last = link;
+    }
+
+    vmm_unmap_range(pml4, va, pages * PAGE_SIZE);
+
+    while (head) {
+        run_link_t* link = (run_link_t*)(head + hhdm_offset);
+        uint64_t next = link->next;
+        if (link->count > 1) {
+            pmm_free_pages((void*)head, link->count);
+        } else {
+            pmm_free_page((void*)head);
+        }
+        head = next;
+    }
+}
+
+void* vmalloc_owned(size_t size, pmm_owner_t owner) {
+    if (size == 0) return NULL;
+
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // One contiguous run maps with a single walk, and the area is placed at
+    // the run's offset in a 2MB page so the aligned part gets 2MB pages;
+    // otherwise back it a frame at a time
+    void* run = (pages > 1) ? pmm_alloc_pages(pages) : NULL;
+    uint64_t va = area_alloc(pages, run ? ((uint64_t)run / PAGE_SIZE) % LARGE_PAGES : 0);
+    if (!va) {
+        if (run) pmm_free_pages(run, pages);
+        return NULL;
+    }
+
+    uint64_t* pml4 = vmm_get_kernel_pml4();
+    uint64_t flags = PTE_PRESENT | PTE_RW | PTE_NX;
+
+    if (run) {
+        pmm_set_owner(run, pages, owner);
+        vmm_map_range(pml4, va, (uint64_t)run, pages * PAGE_SIZE, flags);
+    } else {
+        for (uint64_t i = 0; i < pages; i++) {
+            void* frame = pmm_alloc_page();
+            if (!frame) {
+                // Give back what was mapped so far
+                unmap_and_free(va, i);
+                area_free(va, pages);
+                return NULL;
+            }
+            pmm_set_owner(frame, 1, owner);
+            vmm_map(pml4, va + i * PAGE_SIZE, (uint64_t)frame, flags);
+        }
+    }
+
+    __atomic_add_fetch(&stats.vmalloc_pages, pages, __ATOMIC_RELAXED);
+    return (void*)va;
+}
+
+void* vmalloc(size_t size) {
+    return vmalloc_owned(size, PMM_OWNER_KERNEL);
+}
+
+int is_vmalloc_addr(const void* addr) {
+    return (uint64_t)addr >= VMALLOC_START && (uint64_t)addr < VMALLOC_START + VMALLOC_SIZE;
+}
+
+size_t vmalloc_size(const void* addr) {
+    return area_pages((uint64_t)addr) * PAGE_SIZE;
+}
+
+void vfree(void* addr) {
+    if (!addr) return;
+
+    uint64_t va = (uint64_t)addr;
+    uint64_t pages = area_pages(va);
+
+    unmap_and_free(va, pages);
+    area_free(va, pages);
+    __atomic_sub_fetch(&stats.vmalloc_pages, pages, __ATOMIC_RELAXED);
+}
+
+void* ioremap(uint64_t phys, size_t len, uint64_t cache_type) {
+    if (len == 0) return NULL;
+
+    uint64_t offset = phys & (PAGE_SIZE - 1);
+    uint64_t base = phys - offset;
+    uint64_t pages = (offset + len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint64_t va = area_alloc(pages, (base / PAGE_SIZE) % LARGE_PAGES);
+    if (!va) return NULL;
+
+    vmm_map_range(vmm_get_kernel_pml4(), va, base, pages * PAGE_SIZE,
+                  PTE_PRESENT | PTE_RW | PTE_NX | cache_type);
+
+    __atomic_add_fetch(&stats.ioremap_pages, pages, __ATOMIC_RELAXED);
+    return (void*)(va + offset);
+}
+
+void iounmap(void* addr) {
+    if (!addr) return;
+
+    uint64_t va = (uint64_t)addr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t pages = area_pages(va);
+
+    vmm_unmap_range(vmm_get_kernel_pml4(), va, pages * PAGE_SIZE);
+    area_free(va, pages);
+    __atomic_sub_fetch(&stats.ioremap_pages, pages, __ATOMIC_RELAXED);
+}
+
+void vmalloc_get_stats(vmalloc_stats_t* out) {
+    *out = stats;
+}
@@ -0,0 +1,51 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pmm.h"
+
+// Kernel virtual address range handed out by vmalloc() and ioremap().
+// Every area gets one unmapped guard page below it; areas are placed bottom
+// up, so the guard of the next one also sits above it.
+#define VMALLOC_START   0xffffc00000000000
+#define VMALLOC_SIZE    (4ULL << 30)
+
+// Set up the range allocator. Needs the PMM and VMM.
+void vmalloc_init(void);
+
+// Virtually contiguous, page-backed kernel memory (rounded up to pages, not
+// cleared). Sizes of 2MB and up are placed so they can use 2MB pages.
+void* vmalloc(size_t size);
+
+// Same, with the backing frames tagged as 'owner'
+void* vmalloc_owned(size_t size, pmm_owner_t owner);
+
+// Unmap an area from vmalloc() and free its frames
+void vfree(void* addr);
+
+// Whether 'addr' lies in the vmalloc range
+int is_vmalloc_addr(const void* addr);
+
+// Mapped size of the vmalloc() area starting at 'addr'
+size_t vmalloc_size(const void* addr);
+
+// Map 'len' bytes of device memory at 'phys' with a memory type from
+// mm/vmm.h (PTE_UC, PTE_WC, or 0 for write-back). Returns the address
+// 'phys' appears at, or NULL if the range is exhausted.
+void* ioremap(uint64_t phys, size_t len, uint64_t cache_type);
+
+// Remove a mapping made by ioremap()
+void iounmap(void* addr);
+
+typedef struct {
+    uint64_t areas;         // Live areas
+    uint64_t vmalloc_pages; // Pages backed by vmalloc()
+    uint64_t ioremap_pages; // Pages mapped by ioremap()
+    uint64_t large_aligned; // Areas placed for 2MB pages
+    uint64_t failures;      // Requests the range could not satisfy
+} vmalloc_stats_t;
+
+void vmalloc_get_stats(vmalloc_stats_t* out);
+
+#endif
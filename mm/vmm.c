@@ -3,13 +3,103 @@
 #include "../lib/string.h"
 #include "../lib/printk.h"
 #include "../lib/panic.h"
+#include "../lib/spinlock.h"
+#include "../arch/cpu.h"
+#include "heap.h"
 
-// External variable from kernel.c
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000
+#define PTE_PAT_LARGE   (1ULL << 12)  // PAT bit position in 2MB/1GB leaves
+#define PTE_PAT_4K      (1ULL << 7)   // PAT bit position in 4KB leaves
+#define PAGE_SIZE_2M    0x200000ULL
+#define PAGE_SIZE_1G    0x40000000ULL
+#define KERNEL_HALF     0xFFFF800000000000ULL
+
+#define CR0_WP          (1ULL << 16)
+#define CR4_PGE         (1ULL << 7)
+#define MSR_EFER        0xC0000080
+#define EFER_NXE        (1ULL << 11)
+#define MSR_PAT         0x277
+
+// PA0 WB, PA1 WT, PA2 UC-, PA3 UC, PA4 WP, PA5 WC, PA6 UC-, PA7 UC.
+// The same layout Limine sets up, so the boot mappings copied into the
+// kernel tables keep their memory types.
+#define PAT_VALUE       0x0007010500070406ULL
+
+// External variables from kernel.c
 extern uint64_t hhdm_offset;
+extern uint64_t kernel_phys_base;
+
+// Section boundaries from linker.ld
+extern char __kernel_start[], __text_start[], __rodata_start[], __data_start[], __kernel_end[];
 
 // The kernel's main PML4 table (Virtual Address)
 static uint64_t* kernel_pml4 = NULL;
 
+// CPUID.80000001h:EDX[26], checked in vmm_init
+static int has_1g_pages = 0;
+
+// CR4.PGE is on: upper-half leaves are global and only a PGE toggle
+// (or invlpg of the page) drops them
+static int global_pages = 0;
+
+// EFER.NXE is on: PTE_NX may be used
+static int has_nx = 0;
+
+// IA32_PAT holds PAT_VALUE
+static int pat_enabled = 0;
+
+// --- Demand paging ---
+static vmm_lazy_region_t lazy_regions[VMM_MAX_LAZY_REGIONS];
+static int lazy_region_count = 0;
+static uint64_t zero_page_phys = 0;     // Shared read-only page of zeroes
+static spinlock_t fault_lock;
+static vmm_fault_stats_t fault_stats;
+
+// Pending invalidations of one CPU between vmm_batch_begin() and _end().
+// The same list is what a future TLB shootdown would send to other CPUs.
+typedef struct {
+    uint64_t pages[VMM_FLUSH_FULL_THRESHOLD];
+    uint32_t count;
+    uint32_t depth;     // Nesting level of begin/end
+    int full;           // Too many pages queued: reload CR3 instead
+    int global;         // Some queued page is global: a CR3 reload is not enough
+    int retire;         // Other PCIDs may cache a kernel change (see pcid_note_kernel_change)
+    uint64_t* free_tables;  // Emptied page tables, chained through their first word
+} tlb_batch_t;
+
+static tlb_batch_t tlb_batch[MAX_CPUS];
+static vmm_tlb_stats_t tlb_stats;
+static uint64_t tables_freed = 0;
+
+// --- PCIDs ---
+// Each CPU hands out PCIDs 1..PCID_MAX to address spaces as they are switched
+// to. When it runs out, its generation moves on: every space's PCID on that
+// CPU becomes stale and is reassigned (and flushed) on its next switch-in.
+#define PCID_MAX        4095
+#define CR3_NOFLUSH     (1ULL << 63)
+#define CR4_PCIDE       (1ULL << 17)
+
+static int pcid_enabled = 0;
+static uint16_t pcid_next[MAX_CPUS];
+static uint64_t pcid_generation[MAX_CPUS];
+
+static vmm_space_t kernel_space;
+static vmm_space_t* current_space[MAX_CPUS];
+
+// Bumped whenever a new upper-half PML4 entry appears in kernel_pml4;
+// spaces copy the upper half again when they see a newer value
+static uint64_t kernel_pml4_gen = 0;
+
+// invlpg and CR3 reloads only reach the current PCID, except that invlpg
+// drops a global leaf from all of them. A change to the shared kernel half
+// they may still cache must not survive there, so retire them all.
+static inline void pcid_invalidate_others(void) {
+    if (pcid_enabled) {
+        pcid_generation[cpu_current_id()]++;
+        tlb_stats.pcid_retires++;
+    }
+}
+
 // Helper: Get Physical Address from Virtual (HHDM subtraction)
 static inline uint64_t virt_to_phys(void* vaddr) {
     return (uint64_t)vaddr - hhdm_offset;
@@ -20,31 +110,248 @@ static inline void* phys_to_virt(uint64_t paddr) {
     return (void*)(paddr + hhdm_offset);
 }
 
-// Helper: Flush TLB for a specific address
-static inline void tlb_flush(uint64_t vaddr) {
+static inline void invlpg(uint64_t vaddr) {
     __asm__ volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
 }
 
+// Drop every non-global translation (of the current PCID)
+static inline void tlb_flush_all(void) {
+    write_cr3(read_cr3());
+}
+
+// Drop every translation, global ones and all PCIDs included
+static inline void tlb_flush_global(void) {
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+}
+
+// PTE_GLOBAL for upper-half leaves, which every address space shares
+static inline uint64_t global_flag(uint64_t vaddr) {
+    return (global_pages && vaddr >= KERNEL_HALF) ? PTE_GLOBAL : 0;
+}
+
+// Other PCIDs may cache an upper-half change that invlpg cannot reach there:
+// a non-global kernel leaf, or kernel paging structures (a table freed, a
+// large leaf split, a PML4 entry added). Retire them when the batch ends,
+// or right away outside one. Lower-half changes stay in the current PCID.
+static void pcid_note_kernel_change(void) {
+    uint64_t rflags = cpu_irq_save();
+    tlb_batch_t* batch = &tlb_batch[cpu_current_id()];
+    if (batch->depth > 0) {
+        batch->retire = 1;
+    } else {
+        pcid_invalidate_others();
+    }
+    cpu_irq_restore(rflags);
+}
+
+// Helper: Flush TLB for a specific address, or queue it inside a batch
+static void tlb_flush(uint64_t vaddr) {
+    uint64_t rflags = cpu_irq_save();
+    tlb_batch_t* batch = &tlb_batch[cpu_current_id()];
+
+    if (batch->depth == 0) {
+        invlpg(vaddr);
+        tlb_stats.invlpg++;
+    } else if (batch->count < VMM_FLUSH_FULL_THRESHOLD) {
+        batch->pages[batch->count++] = vaddr;
+    } else {
+        batch->full = 1;
+        tlb_stats.avoided++;
+    }
+    if (batch->depth > 0 && global_flag(vaddr)) {
+        batch->global = 1;
+    }
+    cpu_irq_restore(rflags);
+
+    if (vaddr >= KERNEL_HALF && !global_flag(vaddr)) {
+        pcid_note_kernel_change();
+    }
+}
+
+void vmm_batch_begin(void) {
+    uint64_t rflags = cpu_irq_save();
+    tlb_batch[cpu_current_id()].depth++;
+    cpu_irq_restore(rflags);
+}
+
+void vmm_batch_end(void) {
+    uint64_t rflags = cpu_irq_save();
+    tlb_batch_t* batch = &tlb_batch[cpu_current_id()];
+
+    if (batch->depth == 0 || --batch->depth > 0) {
+        cpu_irq_restore(rflags);
+        return;
+    }
+
+    // Only this CPU runs kernel code for now. With SMP, the same page list
+    // (or "full") is what gets sent to the other CPUs here.
+    if (batch->full && batch->global) {
+        tlb_flush_global();
+        tlb_stats.full_flushes++;
+        tlb_stats.global_flushes++;
+        tlb_stats.avoided += batch->count;
+    } else if (batch->full) {
+        tlb_flush_all();
+        tlb_stats.full_flushes++;
+        tlb_stats.avoided += batch->count;
+    } else {
+        for (uint32_t i = 0; i < batch->count; i++) {
+            invlpg(batch->pages[i]);
+        }
+        tlb_stats.invlpg += batch->count;
+    }
+    if (batch->count > 0 || batch->full) {
+        tlb_stats.batches++;
+    }
+    if (batch->retire) {
+        pcid_invalidate_others();
+    }
+
+    batch->count = 0;
+    batch->full = 0;
+    batch->global = 0;
+    batch->retire = 0;
+
+    // Only now can no cached walk still point into the emptied tables
+    while (batch->free_tables) {
+        uint64_t* table = batch->free_tables;
+        batch->free_tables = (uint64_t*)table[0];
+        pmm_free_page((void*)virt_to_phys(table));
+        tables_freed++;
+    }
+    cpu_irq_restore(rflags);
+}
+
+void vmm_get_tlb_stats(vmm_tlb_stats_t* out) {
+    *out = tlb_stats;
+}
+
+uint64_t vmm_get_tables_freed(void) {
+    return tables_freed;
+}
+
+// --- Page table population counts ---
+// page_t.private of every PDPT, PD and PT frame counts its present entries,
+// so unmapping can tell when a table has become empty. PML4s are not counted.
+
+static inline page_t* table_page(uint64_t* entry) {
+    return pmm_phys_to_page(virt_to_phys(entry) & ~(uint64_t)(PAGE_SIZE - 1));
+}
+
+// 'entry' (in a counted table) became present / not present
+static inline void table_inc(uint64_t* entry) {
+    table_page(entry)->private++;
+}
+
+static inline void table_dec(uint64_t* entry) {
+    table_page(entry)->private--;
+}
+
+// Free 'table' once the current batch has flushed. It is empty, so its
+// first word can hold the chain.
+static void table_free_deferred(uint64_t* table) {
+    uint64_t rflags = cpu_irq_save();
+    tlb_batch_t* batch = &tlb_batch[cpu_current_id()];
+    table[0] = (uint64_t)batch->free_tables;
+    batch->free_tables = table;
+    cpu_irq_restore(rflags);
+}
+
+// Unhook and free the page tables an unmap at 'vaddr' left empty, bottom up.
+// entry[0..2] are the PML4, PDPT and PD entries that were walked; 'level'
+// says which table lost an entry (2 = the PT under entry[2], 1 = the PD,
+// 0 = the PDPT). Must run inside a batch: the leaves it cleared are
+// flushed before the tables are reused.
+static void release_empty_tables(uint64_t** entry, int level, uint64_t vaddr) {
+    for (int i = level; i >= 0; i--) {
+        uint64_t* table = phys_to_virt(*entry[i] & PTE_ADDR_MASK);
+        if (table_page(table)->private != 0) return;
+
+        // Kernel PDPTs are shared by every address space: they stay
+        if (i == 0 && vaddr >= KERNEL_HALF) return;
+
+        *entry[i] = 0;
+        if (i > 0) {
+            table_dec(entry[i]);
+        }
+        table_free_deferred(table);
+        if (vaddr >= KERNEL_HALF) {
+            pcid_note_kernel_change();
+        }
+    }
+}
+
+static uint64_t* alloc_table(void) {
+    // Already zeroed, usually from the idle-time pool
+    void* table_phys = pmm_alloc_zeroed_page();
+    if (!table_phys) {
+        panic("VMM: OOM during page table walk");
+    }
+    pmm_set_owner(table_phys, 1, PMM_OWNER_PAGETABLE);
+    return (uint64_t*)phys_to_virt((uint64_t)table_phys);
+}
+
+// Replace a large leaf with a table of 512 smaller leaves covering the same
+// memory with the same attributes. 'level' is 3 for a 1GB PDPT entry and 2
+// for a 2MB PD entry; 'vaddr' is any address inside the large page.
+static void split_large_page(uint64_t* entry, int level, uint64_t vaddr) {
+    uint64_t old = *entry;
+    uint64_t* table = alloc_table();
+    uint64_t attrs = old & (0xFFFULL | PTE_NX);
+
+    if (level == 3) {
+        uint64_t base = old & 0x000FFFFFC0000000;
+        for (int i = 0; i < 512; i++) {
+            table[i] = (base + i * PAGE_SIZE_2M) | attrs | (old & PTE_PAT_LARGE);
+        }
+    } else {
+        uint64_t base = old & 0x000FFFFFFFE00000;
+        uint64_t pat = (old & PTE_PAT_LARGE) ? PTE_PAT_4K : 0;
+        for (int i = 0; i < 512; i++) {
+            table[i] = (base + i * PAGE_SIZE) | (attrs & ~PTE_HUGE) | pat;
+        }
+    }
+
+    table_page(table)->private = 512;
+
+    *entry = virt_to_phys(table) | PTE_PRESENT | PTE_RW | (old & PTE_USER);
+    // One invlpg anywhere in a large page drops its whole translation
+    tlb_flush(vaddr);
+    if (vaddr >= KERNEL_HALF) {
+        pcid_note_kernel_change();
+    }
+}
+
 // Helper: Get the next level table. 
 // If it doesn't exist, allocate it with 'flags'.
 // If it DOES exist, ensure 'flags' are applied (e.g. upgrading Kernel entry to User).
-static uint64_t* get_next_level(uint64_t* table_entry, uint64_t flags) {
+// A large page in the way is split first; 'level' says which kind it would
+// be (3 = PDPT entry, 2 = PD entry) and 'vaddr' is the address being walked.
+static uint64_t* get_next_level(uint64_t* table_entry, uint64_t flags, int level, uint64_t vaddr) {
+    if ((*table_entry & PTE_PRESENT) && (*table_entry & PTE_HUGE) && level < 4) {
+        split_large_page(table_entry, level, vaddr);
+    }
+
     // 1. Check if the entry exists
     if (!(*table_entry & PTE_PRESENT)) {
         // Allocate new table
-        void* new_table_phys = pmm_alloc_page();
-        if (!new_table_phys) {
-            panic("VMM: OOM during page table walk");
-        }
-
-        // Zero it out
-        void* new_table_virt = phys_to_virt((uint64_t)new_table_phys);
-        memset(new_table_virt, 0, 4096);
+        uint64_t* new_table_virt = alloc_table();
 
         // Set the entry
-        *table_entry = (uint64_t)new_table_phys | flags;
+        *table_entry = virt_to_phys(new_table_virt) | flags;
+        if (level < 4) {
+            table_inc(table_entry);
+        }
+
+        // A new upper-half PML4 entry has to reach the other address spaces
+        if (table_entry >= &kernel_pml4[256] && table_entry < &kernel_pml4[512]) {
+            kernel_pml4_gen++;
+            pcid_note_kernel_change();
+        }
         
-        return (uint64_t*)new_table_virt;
+        return new_table_virt;
     } 
     else {
         // 2. Entry exists: Check if we need to upgrade permissions
@@ -77,9 +384,9 @@ void vmm_map(uint64_t* pml4, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
     }
 
     // Walk the tables
-    uint64_t* pdpt = get_next_level(&pml4[pml4_idx], intermediate_flags);
-    uint64_t* pd   = get_next_level(&pdpt[pdpt_idx], intermediate_flags);
-    uint64_t* pt   = get_next_level(&pd[pd_idx], intermediate_flags);
+    uint64_t* pdpt = get_next_level(&pml4[pml4_idx], intermediate_flags, 4, vaddr);
+    uint64_t* pd   = get_next_level(&pdpt[pdpt_idx], intermediate_flags, 3, vaddr);
+    uint64_t* pt   = get_next_level(&pd[pd_idx], intermediate_flags, 2, vaddr);
 
     // Check for double mapping
     if (pt[pt_idx] & PTE_PRESENT) {
@@ -88,33 +395,164 @@ void vmm_map(uint64_t* pml4, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
         panic("VMM: Double mapping detected");
     }
 
-    // Set the leaf entry
-    pt[pt_idx] = paddr | flags;
-    
-    tlb_flush(vaddr);
+    // Set the leaf entry. It was not present, so the TLB holds nothing to flush.
+    pt[pt_idx] = paddr | flags | global_flag(vaddr);
+    table_inc(&pt[pt_idx]);
+    tlb_stats.avoided++;
 }
 
-void vmm_unmap(uint64_t* pml4, uint64_t vaddr) {
-    uint64_t pml4_idx = (vaddr >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (vaddr >> 30) & 0x1FF;
-    uint64_t pd_idx   = (vaddr >> 21) & 0x1FF;
-    uint64_t pt_idx   = (vaddr >> 12) & 0x1FF;
+void vmm_map_range(uint64_t* pml4, uint64_t vaddr, uint64_t paddr, uint64_t len, uint64_t flags) {
+    uint64_t end = vaddr + ((len + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
 
-    if (!(pml4[pml4_idx] & PTE_PRESENT)) return;
-    
-    uint64_t* pdpt = phys_to_virt(pml4[pml4_idx] & 0x000FFFFFFFFFF000);
-    if (!(pdpt[pdpt_idx] & PTE_PRESENT)) return;
+    uint64_t intermediate_flags = PTE_PRESENT | PTE_RW;
+    if (flags & PTE_USER) {
+        intermediate_flags |= PTE_USER;
+    }
+    flags |= global_flag(vaddr);
 
-    uint64_t* pd = phys_to_virt(pdpt[pdpt_idx] & 0x000FFFFFFFFFF000);
-    if (!(pd[pd_idx] & PTE_PRESENT)) return;
+    // Large leaves carry the PAT bit at bit 12 instead of bit 7
+    uint64_t large_flags = (flags & ~PTE_PAT_4K) | PTE_HUGE | ((flags & PTE_PAT_4K) ? PTE_PAT_LARGE : 0);
 
-    uint64_t* pt = phys_to_virt(pd[pd_idx] & 0x000FFFFFFFFFF000);
-    
-    // Clear the entry
-    if (pt[pt_idx] & PTE_PRESENT) {
-        pt[pt_idx] = 0;
-        tlb_flush(vaddr);
+    // New mappings replace not-present entries, which the TLB never caches,
+    // so nothing needs flushing here
+    while (vaddr < end) {
+        uint64_t left = end - vaddr;
+        uint64_t* pdpt = get_next_level(&pml4[(vaddr >> 39) & 0x1FF], intermediate_flags, 4, vaddr);
+
+        uint64_t* pdpt_entry = &pdpt[(vaddr >> 30) & 0x1FF];
+        if (has_1g_pages && !((vaddr | paddr) & (PAGE_SIZE_1G - 1)) &&
+            left >= PAGE_SIZE_1G && !(*pdpt_entry & PTE_PRESENT)) {
+            *pdpt_entry = paddr | large_flags;
+            table_inc(pdpt_entry);
+            tlb_stats.avoided++;
+            vaddr += PAGE_SIZE_1G;
+            paddr += PAGE_SIZE_1G;
+            continue;
+        }
+        uint64_t* pd = get_next_level(pdpt_entry, intermediate_flags, 3, vaddr);
+
+        uint64_t* pd_entry = &pd[(vaddr >> 21) & 0x1FF];
+        if (!((vaddr | paddr) & (PAGE_SIZE_2M - 1)) &&
+            left >= PAGE_SIZE_2M && !(*pd_entry & PTE_PRESENT)) {
+            *pd_entry = paddr | large_flags;
+            table_inc(pd_entry);
+            tlb_stats.avoided++;
+            vaddr += PAGE_SIZE_2M;
+            paddr += PAGE_SIZE_2M;
+            continue;
+        }
+        uint64_t* pt = get_next_level(pd_entry, intermediate_flags, 2, vaddr);
+
+        // Fill the rest of this page table without walking again
+        do {
+            uint64_t* pte = &pt[(vaddr >> 12) & 0x1FF];
+            if (*pte & PTE_PRESENT) {
+                printk("[VMM] Error: VA 0x%llx already mapped to PA 0x%llx\n",
+                       vaddr, *pte & PTE_ADDR_MASK);
+                panic("VMM: Double mapping detected");
+            }
+            *pte = paddr | flags;
+            table_inc(pte);
+            tlb_stats.avoided++;
+            vaddr += PAGE_SIZE;
+            paddr += PAGE_SIZE;
+        } while (vaddr < end && (vaddr & (PAGE_SIZE_2M - 1)));
+    }
+}
+
+// Start of the next 'size'-aligned block after 'vaddr', or 0 on wrap-around
+static inline uint64_t next_boundary(uint64_t vaddr, uint64_t size) {
+    return (vaddr | (size - 1)) + 1;
+}
+
+void vmm_unmap_range(uint64_t* pml4, uint64_t vaddr, uint64_t len) {
+    uint64_t end = vaddr + ((len + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+
+    vmm_batch_begin();
+
+    while (vaddr < end) {
+        uint64_t left = end - vaddr;
+        uint64_t next;
+
+        uint64_t* pml4_entry = &pml4[(vaddr >> 39) & 0x1FF];
+        if (!(*pml4_entry & PTE_PRESENT)) {
+            next = next_boundary(vaddr, 512 * PAGE_SIZE_1G);
+            goto skip;
+        }
+
+        uint64_t* pdpt = phys_to_virt(*pml4_entry & PTE_ADDR_MASK);
+        uint64_t* pdpt_entry = &pdpt[(vaddr >> 30) & 0x1FF];
+        if (!(*pdpt_entry & PTE_PRESENT)) {
+            next = next_boundary(vaddr, PAGE_SIZE_1G);
+            goto skip;
+        }
+        uint64_t* walked[3] = { pml4_entry, pdpt_entry, NULL };
+        if (*pdpt_entry & PTE_HUGE) {
+            if (!(vaddr & (PAGE_SIZE_1G - 1)) && left >= PAGE_SIZE_1G) {
+                *pdpt_entry = 0;
+                table_dec(pdpt_entry);
+                tlb_flush(vaddr);
+                release_empty_tables(walked, 0, vaddr);
+                vaddr += PAGE_SIZE_1G;
+                continue;
+            }
+            split_large_page(pdpt_entry, 3, vaddr);
+        }
+
+        uint64_t* pd = phys_to_virt(*pdpt_entry & PTE_ADDR_MASK);
+        uint64_t* pd_entry = &pd[(vaddr >> 21) & 0x1FF];
+        if (!(*pd_entry & PTE_PRESENT)) {
+            next = next_boundary(vaddr, PAGE_SIZE_2M);
+            goto skip;
+        }
+        walked[2] = pd_entry;
+        if (*pd_entry & PTE_HUGE) {
+            if (!(vaddr & (PAGE_SIZE_2M - 1)) && left >= PAGE_SIZE_2M) {
+                *pd_entry = 0;
+                table_dec(pd_entry);
+                tlb_flush(vaddr);
+                release_empty_tables(walked, 1, vaddr);
+                vaddr += PAGE_SIZE_2M;
+                continue;
+            }
+            split_large_page(pd_entry, 2, vaddr);
+        }
+
+        // Clear the rest of this page table without walking again
+        uint64_t* pt = phys_to_virt(*pd_entry & PTE_ADDR_MASK);
+        uint64_t pt_vaddr = vaddr;
+        do {
+            uint64_t* pte = &pt[(vaddr >> 12) & 0x1FF];
+            if (*pte & PTE_PRESENT) {
+                *pte = 0;
+                table_dec(pte);
+                tlb_flush(vaddr);
+            }
+            vaddr += PAGE_SIZE;
+        } while (vaddr < end && (vaddr & (PAGE_SIZE_2M - 1)));
+        release_empty_tables(walked, 2, pt_vaddr);
+        continue;
+
+    skip:
+        if (next == 0) break;
+        vaddr = next;
+    }
+
+    vmm_batch_end();
+}
+
+void vmm_remap_range(uint64_t* pml4, uint64_t vaddr, uint64_t len, uint64_t flags) {
+    uint64_t paddr = vmm_virt_to_phys(pml4, vaddr);
+    if (paddr == 0) {
+        panic("VMM: Remap of an unmapped range");
     }
+    // Unmapping flushes the old translations before the new type is used
+    vmm_unmap_range(pml4, vaddr, len);
+    vmm_map_range(pml4, vaddr, paddr, len, flags);
+}
+
+void vmm_unmap(uint64_t* pml4, uint64_t vaddr) {
+    vmm_unmap_range(pml4, vaddr, PAGE_SIZE);
 }
 
 // Virtual to Physical Walker
@@ -129,11 +567,16 @@ uint64_t vmm_virt_to_phys(uint64_t* pml4, uint64_t vaddr) {
     uint64_t* pdpt = phys_to_virt(pml4[pml4_idx] & 0x000FFFFFFFFFF000);
     if (!(pdpt[pdpt_idx] & PTE_PRESENT)) return 0;
 
+    // 1GB Large Page (the HHDM is often mapped with these)
+    if (pdpt[pdpt_idx] & PTE_HUGE) {
+        return (pdpt[pdpt_idx] & 0x000FFFFFC0000000) + (vaddr & 0x3FFFFFFF);
+    }
+
     uint64_t* pd = phys_to_virt(pdpt[pdpt_idx] & 0x000FFFFFFFFFF000);
     if (!(pd[pd_idx] & PTE_PRESENT)) return 0;
 
     // Check for 2MB Large Page (Bit 7)
-    if (pd[pd_idx] & (1 << 7)) {
+    if (pd[pd_idx] & PTE_HUGE) {
         // Mask bits 21-51 for base address
         uint64_t page_phys_base = pd[pd_idx] & 0x000FFFFFFFE00000; 
         // Offset is the lower 21 bits of vaddr
@@ -146,17 +589,135 @@ uint64_t vmm_virt_to_phys(uint64_t* pml4, uint64_t vaddr) {
     return (pt[pt_idx] & 0x000FFFFFFFFFF000) + (vaddr & 0xFFF);
 }
 
+// Deep-copy a boot page table so no live mapping depends on tables in
+// bootloader-reclaimable memory. 'level' is 3 for a PDPT down to 1 for a PT.
+// Returns the physical address of the copy.
+static uint64_t clone_table(uint64_t table_phys, int level) {
+    void* copy_phys = pmm_alloc_page();
+    if (!copy_phys) {
+        panic("VMM: OOM while copying boot page tables");
+    }
+    pmm_set_owner(copy_phys, 1, PMM_OWNER_PAGETABLE);
+
+    uint64_t* src = (uint64_t*)phys_to_virt(table_phys);
+    uint64_t* dst = (uint64_t*)phys_to_virt((uint64_t)copy_phys);
+    uint64_t present = 0;
+
+    for (int i = 0; i < 512; i++) {
+        uint64_t entry = src[i];
+        if (level > 1 && (entry & PTE_PRESENT) && !(entry & PTE_HUGE)) {
+            uint64_t next = clone_table(entry & 0x000FFFFFFFFFF000, level - 1);
+            entry = next | (entry & ~0x000FFFFFFFFFF000);
+        } else if (entry & PTE_PRESENT) {
+            // A leaf of the shared upper half
+            entry |= global_pages ? PTE_GLOBAL : 0;
+        }
+        if (entry & PTE_PRESENT) {
+            present++;
+        }
+        dst[i] = entry;
+    }
+    pmm_phys_to_page((uint64_t)copy_phys)->private = present;
+    return (uint64_t)copy_phys;
+}
+
+// Replace the copied boot mapping of the kernel image with one built from
+// the linker.ld section boundaries: text RX, rodata R, data and bss RW.
+// Sections go through vmm_map_range(), so any 2MB-aligned stretch of one
+// gets a large page.
+static void map_kernel_image(uint64_t nx) {
+    uint64_t vstart = (uint64_t)__kernel_start;
+    uint64_t vend = (uint64_t)__kernel_end;
+
+    uint64_t pbase = kernel_phys_base;
+    if (pbase == 0) {
+        pbase = vmm_virt_to_phys(kernel_pml4, vstart);
+    }
+    if (pbase == 0 || (pbase & (PAGE_SIZE - 1))) {
+        panic("VMM: Cannot locate the kernel image");
+    }
+
+    // Nothing but the image lives in the 2MB blocks around it, so drop
+    // their page tables whole and let the sections start from empty PDs
+    for (uint64_t va = vstart & ~(PAGE_SIZE_2M - 1); va < vend; va += PAGE_SIZE_2M) {
+        uint64_t* pml4_entry = &kernel_pml4[(va >> 39) & 0x1FF];
+        if (!(*pml4_entry & PTE_PRESENT)) continue;
+
+        uint64_t* pdpt = phys_to_virt(*pml4_entry & PTE_ADDR_MASK);
+        uint64_t* pdpt_entry = &pdpt[(va >> 30) & 0x1FF];
+        if (!(*pdpt_entry & PTE_PRESENT)) continue;
+        if (*pdpt_entry & PTE_HUGE) {
+            split_large_page(pdpt_entry, 3, va);
+        }
+
+        uint64_t* pd = phys_to_virt(*pdpt_entry & PTE_ADDR_MASK);
+        uint64_t* pd_entry = &pd[(va >> 21) & 0x1FF];
+        if (!(*pd_entry & PTE_PRESENT)) continue;
+        if (!(*pd_entry & PTE_HUGE)) {
+            pmm_free_page((void*)(*pd_entry & PTE_ADDR_MASK));
+        }
+        *pd_entry = 0;
+        table_dec(pd_entry);
+    }
+
+    struct {
+        uint64_t start, end, flags;
+    } sections[] = {
+        { vstart,                    (uint64_t)__text_start,   PTE_PRESENT | nx },          // Limine requests
+        { (uint64_t)__text_start,    (uint64_t)__rodata_start, PTE_PRESENT },               // .text
+        { (uint64_t)__rodata_start,  (uint64_t)__data_start,   PTE_PRESENT | nx },          // .rodata
+        { (uint64_t)__data_start,    vend,                     PTE_PRESENT | PTE_RW | nx }, // .data, .bss
+    };
+
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+        if (sections[i].end > sections[i].start) {
+            vmm_map_range(kernel_pml4, sections[i].start, pbase + (sections[i].start - vstart),
+                          sections[i].end - sections[i].start, sections[i].flags);
+        }
+    }
+
+    printk("[VMM] Kernel image at phys 0x%llx: text %lluK, rodata %lluK, data+bss %lluK\n",
+           pbase, ((uint64_t)__rodata_start - (uint64_t)__text_start) / 1024,
+           ((uint64_t)__data_start - (uint64_t)__rodata_start) / 1024,
+           (vend - (uint64_t)__data_start) / 1024);
+}
+
 void vmm_init(void) {
     // 1. Allocate a new PML4 table
     void* new_pml4_phys = pmm_alloc_page();
     if (!new_pml4_phys) {
         panic("VMM: Failed to allocate kernel PML4");
     }
+    pmm_set_owner(new_pml4_phys, 1, PMM_OWNER_PAGETABLE);
 
     // 2. Get Virtual Address of new PML4
     kernel_pml4 = (uint64_t*)phys_to_virt((uint64_t)new_pml4_phys);
     memset(kernel_pml4, 0, 4096);
 
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        has_1g_pages = (edx >> 26) & 1;
+        has_nx = (edx >> 20) & 1;
+    }
+    if (has_nx) {
+        wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+    }
+
+    // CPUID.01h:EDX[13]: global pages. Entries get PTE_GLOBAL from here on;
+    // the bit does nothing until CR4.PGE is set after the switch.
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    global_pages = (edx >> 13) & 1;
+
+    // CPUID.01h:EDX[16]: PAT. Caches are written back before the memory
+    // types change; the CR3 switch below drops the stale translations.
+    if ((edx >> 16) & 1) {
+        __asm__ volatile("wbinvd" ::: "memory");
+        wrmsr(MSR_PAT, PAT_VALUE);
+        pat_enabled = 1;
+    }
+
     // 3. Get the current (Limine) PML4
     uint64_t current_cr3;
     __asm__ volatile("mov %%cr3, %0" : "=r"(current_cr3));
@@ -164,17 +725,340 @@ void vmm_init(void) {
     uint64_t* old_pml4 = (uint64_t*)phys_to_virt(current_cr3 & 0x000FFFFFFFFFF000);
 
     // 4. Copy the Higher Half (Kernel + HHDM)
-    // Entries 256 to 511 cover 0xffff800000000000 to 0xffffffffffffffff
+    // Entries 256 to 511 cover 0xffff800000000000 to 0xffffffffffffffff.
+    // The tables below them are copied too: Limine's live in memory we
+    // hand back to the PMM after boot.
     for (int i = 256; i < 512; i++) {
-        kernel_pml4[i] = old_pml4[i];
+        uint64_t entry = old_pml4[i];
+        if (entry & PTE_PRESENT) {
+            entry = clone_table(entry & 0x000FFFFFFFFFF000, 3) | (entry & ~0x000FFFFFFFFFF000);
+        }
+        kernel_pml4[i] = entry;
+    }
+
+    // 5. Map the kernel image with per-section permissions
+    map_kernel_image(has_nx ? PTE_NX : 0);
+
+    // 6. Switch to the new PML4. Toggling PGE on afterwards also drops any
+    // global entries left from the boot tables; WP makes the read-only
+    // sections read-only for the kernel too.
+    write_cr3((uint64_t)new_pml4_phys);
+    uint64_t cr4 = read_cr4() & ~CR4_PGE;
+    write_cr4(cr4);
+    if (global_pages) {
+        write_cr4(cr4 | CR4_PGE);
+    }
+    write_cr0(read_cr0() | CR0_WP);
+
+    kernel_space.pml4 = kernel_pml4;
+    kernel_space.pml4_phys = (uint64_t)new_pml4_phys;
+    kernel_space.kernel_gen = kernel_pml4_gen;
+    current_space[cpu_current_id()] = &kernel_space;
+
+    // Backing for reads of lazily mapped memory that was never written
+    void* zero_page = pmm_alloc_zeroed_page();
+    if (!zero_page) {
+        panic("VMM: Failed to allocate the zero page");
     }
+    pmm_set_owner(zero_page, 1, PMM_OWNER_KERNEL);
+    zero_page_phys = (uint64_t)zero_page;
+    spinlock_init(&fault_lock);
 
-    // 5. Switch to the new PML4
-    __asm__ volatile("mov %0, %%cr3" :: "r"((uint64_t)new_pml4_phys) : "memory");
+    // 7. Tag TLB entries with PCIDs when the CPU can (CPUID.01h:ECX[17]).
+    // CR4.PCIDE may only be set while the current PCID is 0, as it is here.
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (ecx & (1 << 17)) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcid_enabled = 1;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            pcid_next[cpu] = 1;
+            pcid_generation[cpu] = 1;
+        }
+    }
+    printk("[VMM] PCID %s, global pages %s, PAT %s\n", pcid_enabled ? "enabled" : "not supported",
+           global_pages ? "enabled" : "not supported", pat_enabled ? "enabled" : "not supported");
 
     printk("[VMM] Initialized. CR3 switched to new PML4 at 0x%llx\n", (uint64_t)new_pml4_phys);
 }
 
+vmm_space_t* vmm_space_create(void) {
+    vmm_space_t* space = (vmm_space_t*)kmalloc(sizeof(vmm_space_t));
+    if (!space) return NULL;
+    memset(space, 0, sizeof(*space));
+
+    space->pml4 = alloc_table();
+    space->pml4_phys = virt_to_phys(space->pml4);
+
+    // The kernel half is shared: same PDPTs as kernel_pml4
+    for (int i = 256; i < 512; i++) {
+        space->pml4[i] = kernel_pml4[i];
+    }
+    space->kernel_gen = kernel_pml4_gen;
+    return space;
+}
+
+// Free a PDPT (level 3), PD or PT and every table below it
+static void free_table_tree(uint64_t table_phys, int level) {
+    if (level > 1) {
+        uint64_t* table = (uint64_t*)phys_to_virt(table_phys);
+        for (int i = 0; i < 512; i++) {
+            if ((table[i] & PTE_PRESENT) && !(table[i] & PTE_HUGE)) {
+                free_table_tree(table[i] & PTE_ADDR_MASK, level - 1);
+            }
+        }
+    }
+    pmm_free_page((void*)table_phys);
+    tables_freed++;
+}
+
+void vmm_space_destroy(vmm_space_t* space) {
+    if (space == &kernel_space) {
+        panic("VMM: Cannot destroy the kernel address space");
+    }
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (current_space[cpu] == space) {
+            panic("VMM: Destroying a loaded address space");
+        }
+    }
+
+    // Only the lower half is the space's own. Whatever its PCIDs still cache
+    // goes when those PCIDs are handed out again (without NOFLUSH).
+    for (int i = 0; i < 256; i++) {
+        if (space->pml4[i] & PTE_PRESENT) {
+            free_table_tree(space->pml4[i] & PTE_ADDR_MASK, 3);
+        }
+    }
+    pmm_free_page((void*)space->pml4_phys);
+    tables_freed++;
+    kfree(space);
+}
+
+vmm_space_t* vmm_space_kernel(void) {
+    return &kernel_space;
+}
+
+vmm_space_t* vmm_space_current(void) {
+    return current_space[cpu_current_id()];
+}
+
+// Copy the kernel half again if new upper-half PML4 entries appeared
+static int space_sync_kernel(vmm_space_t* space) {
+    if (space->kernel_gen == kernel_pml4_gen) return 0;
+    if (space->pml4 == kernel_pml4) {
+        space->kernel_gen = kernel_pml4_gen;
+        return 0;
+    }
+    for (int i = 256; i < 512; i++) {
+        space->pml4[i] = kernel_pml4[i];
+    }
+    space->kernel_gen = kernel_pml4_gen;
+    return 1;
+}
+
+void vmm_space_switch(vmm_space_t* space) {
+    uint64_t rflags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+
+    space_sync_kernel(space);
+
+    uint64_t cr3 = space->pml4_phys;
+    if (pcid_enabled) {
+        if (space->pcid[cpu] != 0 && space->pcid_gen[cpu] == pcid_generation[cpu]) {
+            // Its TLB entries are still valid: keep them
+            cr3 |= space->pcid[cpu] | CR3_NOFLUSH;
+            tlb_stats.switches_noflush++;
+        } else {
+            if (pcid_next[cpu] > PCID_MAX) {
+                pcid_generation[cpu]++;
+                pcid_next[cpu] = 1;
+                tlb_stats.pcid_rollovers++;
+            }
+            space->pcid[cpu] = pcid_next[cpu]++;
+            space->pcid_gen[cpu] = pcid_generation[cpu];
+            // No NOFLUSH bit: whatever an older owner left under this PCID goes
+            cr3 |= space->pcid[cpu];
+        }
+    }
+
+    write_cr3(cr3);
+    current_space[cpu] = space;
+    tlb_stats.switches++;
+    cpu_irq_restore(rflags);
+}
+
+void vmm_tlb_flush_local(void) {
+    tlb_flush_all();
+    tlb_stats.full_flushes++;
+}
+
+int vmm_pcid_enabled(void) {
+    return pcid_enabled;
+}
+
+int vmm_wc_enabled(void) {
+    return pat_enabled;
+}
+
+// --- Demand paging ---
+
+const vmm_lazy_region_t* vmm_reserve_lazy(const char* name, uint64_t start, uint64_t len, int owner) {
+    if (lazy_region_count >= VMM_MAX_LAZY_REGIONS) {
+        panic("VMM: Too many lazy regions");
+    }
+    vmm_lazy_region_t* region = &lazy_regions[lazy_region_count++];
+    region->name = name;
+    region->start = start & ~(uint64_t)(PAGE_SIZE - 1);
+    region->end = (start + len + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    region->owner = owner;
+    region->resident = 0;
+
+    printk("[VMM] Lazy region '%s': 0x%llx - 0x%llx\n", name, region->start, region->end);
+    return region;
+}
+
+int vmm_get_lazy_regions(const vmm_lazy_region_t** out) {
+    *out = lazy_regions;
+    return lazy_region_count;
+}
+
+static vmm_lazy_region_t* find_lazy_region(uint64_t vaddr) {
+    for (int i = 0; i < lazy_region_count; i++) {
+        if (vaddr >= lazy_regions[i].start && vaddr < lazy_regions[i].end) {
+            return &lazy_regions[i];
+        }
+    }
+    return NULL;
+}
+
+// The 4KB leaf entry for 'vaddr', creating the tables above it
+static uint64_t* walk_pte(uint64_t* pml4, uint64_t vaddr) {
+    uint64_t flags = PTE_PRESENT | PTE_RW;
+    uint64_t* pdpt = get_next_level(&pml4[(vaddr >> 39) & 0x1FF], flags, 4, vaddr);
+    uint64_t* pd   = get_next_level(&pdpt[(vaddr >> 30) & 0x1FF], flags, 3, vaddr);
+    uint64_t* pt   = get_next_level(&pd[(vaddr >> 21) & 0x1FF], flags, 2, vaddr);
+    return &pt[(vaddr >> 12) & 0x1FF];
+}
+
+static int lazy_fault(vmm_lazy_region_t* region, uint64_t page, int write) {
+    uint64_t* pte = walk_pte(kernel_pml4, page);
+    uint64_t flags = PTE_PRESENT | (has_nx ? PTE_NX : 0) | global_flag(page);
+    int upgrade = 0;
+
+    if (*pte & PTE_PRESENT) {
+        // Already resolved, and only the TLB was behind
+        if (!write || (*pte & PTE_RW)) return 1;
+        // A read-only page here that is not the zero page is a real fault
+        if ((*pte & PTE_ADDR_MASK) != zero_page_phys) return 0;
+        upgrade = 1;
+    } else if (!write) {
+        *pte = zero_page_phys | flags;
+        table_inc(pte);
+        fault_stats.zero_maps++;
+        return 1;
+    }
+
+    void* frame = pmm_alloc_zeroed_page();
+    if (!frame) {
+        printk("[VMM] Out of memory backing 0x%llx in '%s'\n", page, region->name);
+        return 0;
+    }
+    pmm_set_owner(frame, 1, (pmm_owner_t)region->owner);
+
+    if (!upgrade) {
+        table_inc(pte);
+    }
+    *pte = (uint64_t)frame | flags | PTE_RW;
+    if (upgrade) {
+        // The read-only zero page translation may be cached
+        tlb_flush(page);
+        fault_stats.zero_upgrades++;
+    }
+    fault_stats.demand_allocs++;
+    region->resident++;
+    return 1;
+}
+
+// Frames looked up per step of vmm_release_lazy(): they are freed once
+// their translations have been flushed
+#define RELEASE_CHUNK 64
+
+uint64_t vmm_release_lazy(uint64_t start, uint64_t len) {
+    uint64_t end = (start + len) & ~(uint64_t)(PAGE_SIZE - 1);
+    start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (end <= start) return 0;
+
+    vmm_lazy_region_t* region = find_lazy_region(start);
+    if (!region || end > region->end) {
+        panic("VMM: Release outside a lazy region");
+    }
+
+    uint64_t freed = 0;
+    spinlock_acquire(&fault_lock);
+    for (uint64_t chunk = start; chunk < end; chunk += RELEASE_CHUNK * PAGE_SIZE) {
+        uint64_t frames[RELEASE_CHUNK];
+        uint64_t count = 0;
+        uint64_t pages = (end - chunk) / PAGE_SIZE;
+        if (pages > RELEASE_CHUNK) pages = RELEASE_CHUNK;
+
+        for (uint64_t i = 0; i < pages; i++) {
+            uint64_t phys = vmm_virt_to_phys(kernel_pml4, chunk + i * PAGE_SIZE);
+            // Pages that were only read map the shared zero page
+            if (phys && phys != zero_page_phys) {
+                frames[count++] = phys;
+            }
+        }
+        vmm_unmap_range(kernel_pml4, chunk, pages * PAGE_SIZE);
+        for (uint64_t i = 0; i < count; i++) {
+            pmm_free_page((void*)frames[i]);
+        }
+        freed += count;
+    }
+    region->resident -= freed;
+    spinlock_release(&fault_lock);
+    return freed;
+}
+
+int vmm_handle_fault(uint64_t vaddr, uint64_t error_code) {
+    uint64_t start = rdtsc();
+    int handled = 0;
+
+    spinlock_acquire(&fault_lock);
+    fault_stats.faults++;
+
+    vmm_space_t* space = current_space[cpu_current_id()];
+    if (vaddr >= KERNEL_HALF && space && space_sync_kernel(space)) {
+        // The kernel half grew while this space was loaded
+        fault_stats.kernel_syncs++;
+        handled = 1;
+    } else if (!(error_code & (PF_USER | PF_RSVD | PF_FETCH))) {
+        vmm_lazy_region_t* region = find_lazy_region(vaddr);
+        if (region) {
+            handled = lazy_fault(region, vaddr & ~(uint64_t)(PAGE_SIZE - 1),
+                                 (error_code & PF_WRITE) != 0);
+        }
+        // Resolving may have added a kernel PML4 entry the space lacks
+        if (handled && space) {
+            space_sync_kernel(space);
+        }
+    }
+
+    if (!handled) {
+        fault_stats.unresolved++;
+    }
+
+    uint64_t cycles = rdtsc() - start;
+    fault_stats.total_cycles += cycles;
+    if (cycles > fault_stats.max_cycles) {
+        fault_stats.max_cycles = cycles;
+    }
+    spinlock_release(&fault_lock);
+    return handled;
+}
+
+void vmm_get_fault_stats(vmm_fault_stats_t* out) {
+    *out = fault_stats;
+}
+
 uint64_t* vmm_get_kernel_pml4(void) {
     return kernel_pml4;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "../arch/cpu.h"
 
 // Page Table Entry Flags
 #define PTE_PRESENT   (1ULL << 0)
@@ -10,23 +11,163 @@
 #define PTE_USER      (1ULL << 2)
 #define PTE_PWT       (1ULL << 3)  // Page Write Through
 #define PTE_PCD       (1ULL << 4)  // Page Cache Disable
+#define PTE_HUGE      (1ULL << 7)  // 2MB/1GB page (PD/PDPT entries only)
+#define PTE_PAT       (1ULL << 7)  // PAT index bit 2 (4KB leaves; vmm_map_range moves it for large ones)
+#define PTE_GLOBAL    (1ULL << 8)  // Survives CR3 reloads (leaves only)
 #define PTE_NX        (1ULL << 63) // No Execute
 
-// Initialize VMM (Create new PML4, copy kernel mappings, switch CR3)
+// Initialize VMM (Create new PML4, copy the HHDM, map the kernel image
+// section by section, switch CR3)
 void vmm_init(void);
 
-// Map a virtual address to a physical address
+// Map a virtual address to a physical address. Upper-half mappings are
+// shared by every address space and get PTE_GLOBAL when the CPU has it.
 // pml4: Virtual address of the PML4 table
 // vaddr: Virtual address to map
 // paddr: Physical address to map to
 // flags: PTE flags (Present, RW, etc.)
 void vmm_map(uint64_t* pml4, uint64_t vaddr, uint64_t paddr, uint64_t flags);
 
-// Unmap a page
+// Map 'len' bytes (rounded up to pages) of contiguous physical memory.
+// Uses 1GB and 2MB pages wherever vaddr and paddr are both aligned, and
+// fills runs of 4KB entries without re-walking the upper levels.
+void vmm_map_range(uint64_t* pml4, uint64_t vaddr, uint64_t paddr, uint64_t len, uint64_t flags);
+
+// Unmap a page. A large page around it is split first.
 void vmm_unmap(uint64_t* pml4, uint64_t vaddr);
 
+// Unmap 'len' bytes (rounded up to pages). Large pages fully inside the
+// range are dropped whole; ones straddling its edges are split. Page tables
+// left empty are freed, except the kernel half's PDPTs.
+void vmm_unmap_range(uint64_t* pml4, uint64_t vaddr, uint64_t len);
+
+// Map an already mapped, physically contiguous range again with new
+// 'flags', e.g. to change its memory type
+void vmm_remap_range(uint64_t* pml4, uint64_t vaddr, uint64_t len, uint64_t flags);
+
+// Physical address 'vaddr' maps to in 'pml4', or 0 if it is not mapped
+uint64_t vmm_virt_to_phys(uint64_t* pml4, uint64_t vaddr);
+
+// Memory types, as selected through the PAT that vmm_init() programs:
+// PA0-PA3 keep their reset values (WB, WT, UC-, UC), PA4 is WP, PA5 WC
+#define PTE_UC        (PTE_PCD | PTE_PWT)
+#define PTE_WC        (PTE_PAT | PTE_PWT)
+
 // Helper macro for MMIO mappings
-#define PTE_MMIO      (PTE_PRESENT | PTE_RW | PTE_PCD | PTE_PWT | PTE_NX)
+#define PTE_MMIO      (PTE_PRESENT | PTE_RW | PTE_UC | PTE_NX)
+
+// Framebuffers and prefetchable BARs: writes are buffered and merged
+#define PTE_MMIO_WC   (PTE_PRESENT | PTE_RW | PTE_WC | PTE_NX)
+
+// Number of queued invalidations above which a batch reloads CR3 instead
+#define VMM_FLUSH_FULL_THRESHOLD 32
+
+// Batch TLB invalidations: flushes requested between begin and end are
+// collected and issued at the final end, either as invlpg per page or as
+// one full flush. Calls nest.
+void vmm_batch_begin(void);
+void vmm_batch_end(void);
+
+typedef struct {
+    uint64_t invlpg;            // Single-page invalidations issued
+    uint64_t full_flushes;      // CR3 reloads issued by batches
+    uint64_t global_flushes;    // ...that also had to drop global entries
+    uint64_t batches;           // Batches that had something to flush
+    uint64_t avoided;           // Invalidations skipped (new mappings, or folded into a full flush)
+    uint64_t switches;          // Address space switches
+    uint64_t switches_noflush;  // ...that kept the TLB thanks to PCIDs
+    uint64_t pcid_rollovers;    // Times a CPU ran out of PCIDs
+    uint64_t pcid_retires;      // Times kernel changes retired the other PCIDs
+} vmm_tlb_stats_t;
+
+void vmm_get_tlb_stats(vmm_tlb_stats_t* out);
+
+// Page table pages freed since boot (emptied by unmaps, or torn down)
+uint64_t vmm_get_tables_freed(void);
+
+// An address space: its own lower half, the kernel's upper half
+typedef struct {
+    uint64_t* pml4;                 // Virtual (HHDM) address
+    uint64_t pml4_phys;
+    uint64_t kernel_gen;            // Version of the kernel half last copied in
+    uint16_t pcid[MAX_CPUS];        // PCID on each CPU (0 = none yet)
+    uint64_t pcid_gen[MAX_CPUS];    // Generation that PCID was assigned in
+} vmm_space_t;
+
+// New address space with an empty lower half
+vmm_space_t* vmm_space_create(void);
+
+// Free a space's page tables and the space itself. The frames mapped in
+// its lower half are not touched: they belong to whoever mapped them.
+// It must not be loaded on any CPU.
+void vmm_space_destroy(vmm_space_t* space);
+
+// The address space set up by vmm_init()
+vmm_space_t* vmm_space_kernel(void);
+vmm_space_t* vmm_space_current(void);
+
+// Load 'space' on this CPU. With PCIDs, a space whose PCID is still valid
+// keeps its TLB entries across the switch.
+void vmm_space_switch(vmm_space_t* space);
+
+int vmm_pcid_enabled(void);
+
+// PTE_WC really selects write-combining (the CPU has a PAT)
+int vmm_wc_enabled(void);
+
+// Drop this CPU's cached translations for the current address space
+void vmm_tlb_flush_local(void);
+
+// --- Demand paging ---
+// Kernel regions reserved up front but backed on first touch by the page
+// fault handler: a read maps the shared zero page read-only, a write maps
+// a fresh zeroed frame.
+#define VMM_MAX_LAZY_REGIONS 8
+
+// Page fault error code bits
+#define PF_PRESENT  (1ULL << 0)  // Protection violation, not a missing page
+#define PF_WRITE    (1ULL << 1)
+#define PF_USER     (1ULL << 2)
+#define PF_RSVD     (1ULL << 3)
+#define PF_FETCH    (1ULL << 4)
+
+typedef struct {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+    int owner;              // pmm_owner_t given to frames backing it
+    uint64_t resident;      // Frames currently backing it
+} vmm_lazy_region_t;
+
+// Reserve [start, start + len) of the kernel half for demand paging.
+// Nothing in it may be mapped any other way. The region's entry stays put,
+// so its owner can watch 'resident'.
+const vmm_lazy_region_t* vmm_reserve_lazy(const char* name, uint64_t start, uint64_t len, int owner);
+
+// Unmap [start, start + len) of a lazy region and free the frames behind
+// it. The range reads as zeroes again and is backed afresh on the next
+// write. Returns the number of frames freed.
+uint64_t vmm_release_lazy(uint64_t start, uint64_t len);
+
+// Number of lazy regions; *out points at the table
+int vmm_get_lazy_regions(const vmm_lazy_region_t** out);
+
+// Called for ISR 14. Returns 1 if the fault at 'vaddr' was resolved and
+// the faulting instruction can be retried.
+int vmm_handle_fault(uint64_t vaddr, uint64_t error_code);
+
+typedef struct {
+    uint64_t faults;            // Page faults taken
+    uint64_t zero_maps;         // Reads backed by the shared zero page
+    uint64_t demand_allocs;     // Writes backed by a new frame
+    uint64_t zero_upgrades;     // ...that replaced a zero page mapping
+    uint64_t kernel_syncs;      // Fixed by refreshing a stale kernel half
+    uint64_t unresolved;        // Passed on as a real exception
+    uint64_t total_cycles;      // TSC cycles spent in the handler
+    uint64_t max_cycles;
+} vmm_fault_stats_t;
+
+void vmm_get_fault_stats(vmm_fault_stats_t* out);
 
 // Get the kernel's main PML4 table
 uint64_t* vmm_get_kernel_pml4(void);
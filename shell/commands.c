@@ -3,11 +3,20 @@
 #include "../lib/string.h"
 #include "../lib/memory.h"
 #include "../display/terminal.h"
+#include "../display/framebuffer.h"
 #include "../drivers/timer.h"
 #include "../drivers/acpi.h"
 #include "../limine.h"
 #include "../fs/vfs.h"
 #include "../mm/heap.h"
+#include "../mm/pmm.h"
+#include "../mm/numa.h"
+#include "../mm/vmm.h"
+#include "../mm/vmalloc.h"
+#include "../mm/slab.h"
+#include "../mm/arena.h"
+#include "../arch/cpu.h"
+#include "../lib/bitmap.h"
 #include "../gui/bmp.h"
 
 void draw_shell_box(const char* title) {
@@ -325,7 +334,68 @@ void cmd_meminfo(int argc, char **argv) {
            usable_mem / (1024 * 1024), usable_mem / 1024);
     printk("  Reserved:        %llu MB\n", 
            (total_mem - usable_mem) / (1024 * 1024));
+    printk("  Reclaimed:       %llu KB (bootloader/ACPI, after boot)\n",
+           pmm_get_reclaimed_memory() / 1024);
     printk("  Memory Entries:  %llu\n\n", memmap->entry_count);
+
+    printk("NUMA nodes:\n");
+    for (uint32_t node = 0; node < numa_node_count(); node++) {
+        pmm_node_stats_t ns;
+        pmm_get_node_stats(node, &ns);
+        printk("  Node %-2u          %llu MB present, %llu MB free%s\n", node,
+               ns.present_pages * PAGE_SIZE / (1024 * 1024),
+               ns.free_pages * PAGE_SIZE / (1024 * 1024),
+               node == numa_local_node() ? " (this CPU)" : "");
+    }
+    printk("\n");
+
+    printk("Allocated frames by owner:\n");
+    for (int owner = PMM_OWNER_KERNEL; owner < PMM_OWNER_COUNT; owner++) {
+        uint64_t pages = pmm_get_owner_pages(owner);
+        printk("  %-10s %-8llu pages (%llu KB)\n", pmm_owner_name(owner), pages,
+               pages * PAGE_SIZE / 1024);
+    }
+    printk("\n");
+
+    printk("Page tables:\n");
+    printk("  In use:          %llu pages (%llu KB)\n", pmm_get_owner_pages(PMM_OWNER_PAGETABLE),
+           pmm_get_owner_pages(PMM_OWNER_PAGETABLE) * PAGE_SIZE / 1024);
+    printk("  Freed:           %llu pages since boot\n\n", vmm_get_tables_freed());
+
+    printk("Boot arena:\n");
+    printk("  Objects:         %llu (%llu KB in %llu pages)\n\n",
+           boot_arena.allocs, boot_arena.used_bytes / 1024, boot_arena.pages);
+
+    kheap_stats_t hs;
+    kheap_get_stats(&hs);
+    printk("Kernel heap:\n");
+    printk("  Size:            %llu KB (%llu KB used, %llu KB free, %llu KB cached)\n",
+           hs.heap_size / 1024, hs.used_bytes / 1024, hs.free_bytes / 1024,
+           hs.cached_bytes / 1024);
+    printk("  Trimmed:         %llu pages returned to the PMM in %llu passes\n",
+           hs.trimmed_pages, hs.trim_runs);
+    printk("  krealloc:        %llu grown and %llu shrunk in place, %llu moved\n",
+           hs.realloc_grown, hs.realloc_shrunk, hs.realloc_moved);
+    printk("                   %llu KB copied, %llu KB copying avoided\n",
+           hs.copy_done / 1024, hs.copy_avoided / 1024);
+    printk("  Large:           %llu live (%llu KB), %llu since boot\n",
+           hs.large_count, hs.large_bytes / 1024, hs.large_total);
+    printk("  Page runs:       %llu (%llu KB, physically contiguous)\n",
+           hs.page_runs, hs.page_frames * PAGE_SIZE / 1024);
+    printk("  Per-CPU caches (depth %d, batch %d, up to %d bytes):\n",
+           KHEAP_MAG_DEPTH, KHEAP_MAG_BATCH, KHEAP_CACHE_MAX);
+    printk("  %-4s %-7s %-9s %-8s %-8s %-8s %-8s %s\n",
+           "CPU", "Cached", "Hits", "Hit%", "Frees", "Remote", "Refills", "Flushes");
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        kheap_cpu_stats_t cs;
+        kheap_get_cpu_stats(cpu, &cs);
+        uint64_t calls = cs.hits + cs.misses;
+        if (calls + cs.frees == 0) continue;
+        printk("  %-4u %-7llu %-9llu %-8llu %-8llu %-8llu %-8llu %llu\n",
+               cpu, cs.cached, cs.hits, calls ? cs.hits * 100 / calls : 0, cs.frees,
+               cs.remote_frees, cs.refills, cs.flushes);
+    }
+    printk("\n");
     
     printk("Memory Map:\n");
     printk("  %-4s %-18s %-18s %-10s %s\n", 
@@ -463,4 +533,479 @@ void cmd_img(int argc, char **argv) {
 
     // Draw the image at X: 400, Y: 100 (somewhere in the middle of the screen)
     bmp_draw(file->data, 400, 100);
-}
\ No newline at end of file
+}
+
+void cmd_buddyinfo(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    draw_shell_box("Buddy Allocator");
+
+    printk("  %-6s %-10s", "Order", "Block");
+    for (int zone = 0; zone < ZONE_COUNT; zone++) {
+        pmm_zone_stats_t zs;
+        pmm_get_zone_stats(zone, &zs);
+        printk(" %-10s", zs.name);
+    }
+    printk("\n  ");
+    terminal_put_repeated('\xC4', 50);
+    printk("\n");
+
+    for (unsigned int order = 0; order <= PMM_MAX_ORDER; order++) {
+        uint64_t block_kb = (PAGE_SIZE << order) / 1024;
+        printk("  %-6u %-7llu KB", order, block_kb);
+        for (int zone = 0; zone < ZONE_COUNT; zone++) {
+            printk(" %-10llu", pmm_get_free_blocks(zone, order));
+        }
+        printk("\n");
+    }
+
+    printk("\n  %-8s %-12s %-12s %s\n", "Zone", "Present", "Free", "Reserve");
+    for (int zone = 0; zone < ZONE_COUNT; zone++) {
+        pmm_zone_stats_t zs;
+        pmm_get_zone_stats(zone, &zs);
+        printk("  %-8s %-9llu KB %-9llu KB %llu KB\n", zs.name,
+               zs.present_pages * PAGE_SIZE / 1024,
+               zs.free_pages * PAGE_SIZE / 1024,
+               zs.reserve_pages * PAGE_SIZE / 1024);
+    }
+    printk("\n  Free: %llu KB of %llu KB\n\n",
+           pmm_get_free_memory() / 1024, pmm_get_total_memory() / 1024);
+
+    printk("NUMA nodes (%u):\n", numa_node_count());
+    printk("  %-5s %-7s %-12s %-12s %s\n", "Node", "Domain", "Present", "Free", "Distances");
+    for (uint32_t node = 0; node < numa_node_count(); node++) {
+        pmm_node_stats_t ns;
+        pmm_get_node_stats(node, &ns);
+        printk("  %-5u %-7u %-9llu KB %-9llu KB", node, numa_node_domain(node),
+               ns.present_pages * PAGE_SIZE / 1024, ns.free_pages * PAGE_SIZE / 1024);
+        for (uint32_t other = 0; other < numa_node_count(); other++) {
+            printk(" %u", numa_distance(node, other));
+        }
+        printk("\n");
+    }
+    printk("  This CPU is on node %u\n\n", numa_local_node());
+
+    printk("Per-CPU page caches (high %d, batch %d):\n", PMM_PCP_HIGH, PMM_PCP_BATCH);
+    printk("  %-4s %-8s %-8s %-8s %-8s %-8s %s\n",
+           "CPU", "Cached", "Hits", "Misses", "Frees", "Refills", "Drains");
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pmm_pcp_stats_t st;
+        pmm_get_pcp_stats(cpu, &st);
+        if (st.hits + st.misses + st.frees == 0) continue;
+        printk("  %-4u %-8llu %-8llu %-8llu %-8llu %-8llu %llu\n",
+               cpu, st.cached, st.hits, st.misses, st.frees, st.refills, st.drains);
+    }
+
+    pmm_zero_stats_t zs;
+    pmm_get_zero_stats(&zs);
+    printk("\nZero pool: %llu of %d frames ready\n", zs.pooled, PMM_ZERO_POOL_SIZE);
+    printk("  Cleared at idle: %llu KB, pool hits: %llu, misses: %llu\n\n",
+           zs.zeroed * PAGE_SIZE / 1024, zs.hits, zs.misses);
+}
+
+void cmd_bitbench(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    // 1M items = 4 GiB worth of frames. Everything is used except a
+    // run near the end, the worst case for a search that starts at 0.
+    const uint64_t items = 1024 * 1024;
+    const uint64_t run_start = items - 3000;
+    const uint64_t run_len = 2048;
+    const int rounds = 16;
+
+    uint8_t* flat = kmalloc(items / 8);
+    void* storage = kmalloc(hbitmap_storage_size(items));
+    if (!flat || !storage) {
+        printk("Error: Could not allocate benchmark bitmaps.\n");
+        kfree(flat);
+        kfree(storage);
+        return;
+    }
+
+    hbitmap_t hbm;
+    hbitmap_init(&hbm, storage, items, true);
+    hbitmap_clear_range(&hbm, run_start, run_len);
+    memset(flat, 0xFF, items / 8);
+    for (uint64_t i = run_start; i < run_start + run_len; i++) {
+        bitmap_clear(flat, i);
+    }
+
+    draw_shell_box("Bitmap Search Benchmark");
+    printk("  %llu items, free run of %llu at %llu, %d rounds\n\n",
+           items, run_len, run_start, rounds);
+
+    volatile uint64_t found = 0;
+
+    // First zero: per-bit loop vs summary bitmap
+    uint64_t start = rdtsc();
+    for (int r = 0; r < rounds; r++) {
+        for (uint64_t i = 0; i < items; i++) {
+            if (!bitmap_test(flat, i)) { found = i; break; }
+        }
+    }
+    uint64_t flat_first = (rdtsc() - start) / rounds;
+
+    start = rdtsc();
+    for (int r = 0; r < rounds; r++) {
+        found = hbitmap_find_first_zero(&hbm, 0);
+    }
+    uint64_t hbm_first = (rdtsc() - start) / rounds;
+
+    // Zero range: per-bit run counting vs summary bitmap
+    start = rdtsc();
+    for (int r = 0; r < rounds; r++) {
+        uint64_t count = 0;
+        for (uint64_t i = 0; i < items; i++) {
+            if (bitmap_test(flat, i)) { count = 0; continue; }
+            if (++count == run_len) { found = i + 1 - run_len; break; }
+        }
+    }
+    uint64_t flat_range = (rdtsc() - start) / rounds;
+
+    start = rdtsc();
+    for (int r = 0; r < rounds; r++) {
+        found = hbitmap_find_next_zero_range(&hbm, 0, run_len);
+    }
+    uint64_t hbm_range = (rdtsc() - start) / rounds;
+
+    printk("  %-22s %-14s %s\n", "Search", "Per-bit (cyc)", "Summary (cyc)");
+    printk("  %-22s %-14llu %llu\n", "find_first_zero", flat_first, hbm_first);
+    printk("  %-22s %-14llu %llu\n", "find_next_zero_range", flat_range, hbm_range);
+    if (hbm_first > 0 && hbm_range > 0) {
+        printk("\n  Speedup: %llux / %llux\n", flat_first / hbm_first, flat_range / hbm_range);
+    }
+    printk("\n");
+
+    (void)found;
+    kfree(flat);
+    kfree(storage);
+}
+
+void cmd_vmstat(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    draw_shell_box("Virtual Memory");
+
+    vmm_tlb_stats_t tlb;
+    vmm_get_tlb_stats(&tlb);
+    printk("TLB invalidation:\n");
+    printk("  invlpg issued:   %llu\n", tlb.invlpg);
+    printk("  Full flushes:    %llu (batch threshold %d pages)\n",
+           tlb.full_flushes, VMM_FLUSH_FULL_THRESHOLD);
+    printk("  ...with globals: %llu\n", tlb.global_flushes);
+    printk("  Batches:         %llu\n", tlb.batches);
+    printk("  Avoided:         %llu\n\n", tlb.avoided);
+
+    printk("Address spaces (PCID %s):\n", vmm_pcid_enabled() ? "on" : "off");
+    printk("  Switches:        %llu (%llu kept the TLB)\n", tlb.switches, tlb.switches_noflush);
+    printk("  PCID rollovers:  %llu\n", tlb.pcid_rollovers);
+    printk("  PCID retires:    %llu (kernel paging changes)\n\n", tlb.pcid_retires);
+
+    vmm_fault_stats_t pf;
+    vmm_get_fault_stats(&pf);
+    printk("Page faults:\n");
+    printk("  Taken:           %llu (%llu unresolved)\n", pf.faults, pf.unresolved);
+    printk("  Zero page reads: %llu\n", pf.zero_maps);
+    printk("  Frames on write: %llu (%llu replaced the zero page)\n",
+           pf.demand_allocs, pf.zero_upgrades);
+    printk("  Kernel syncs:    %llu\n", pf.kernel_syncs);
+    if (pf.faults > 0) {
+        printk("  Latency:         %llu cycles avg, %llu max\n",
+               pf.total_cycles / pf.faults, pf.max_cycles);
+    }
+
+    const vmm_lazy_region_t* regions;
+    int count = vmm_get_lazy_regions(&regions);
+    printk("\nDemand-paged regions:\n");
+    for (int i = 0; i < count; i++) {
+        printk("  %-8s 0x%llx - 0x%llx  %llu KB resident\n", regions[i].name,
+               regions[i].start, regions[i].end, regions[i].resident * PAGE_SIZE / 1024);
+    }
+
+    vmalloc_stats_t vs;
+    vmalloc_get_stats(&vs);
+    printk("\nvmalloc range (0x%llx, %llu MB):\n", (uint64_t)VMALLOC_START,
+           (uint64_t)(VMALLOC_SIZE >> 20));
+    printk("  Areas:           %llu (%llu placed for 2MB pages)\n", vs.areas, vs.large_aligned);
+    printk("  vmalloc:         %llu KB\n", vs.vmalloc_pages * PAGE_SIZE / 1024);
+    printk("  ioremap:         %llu KB\n", vs.ioremap_pages * PAGE_SIZE / 1024);
+    printk("  Failures:        %llu\n\n", vs.failures);
+}
+
+#define TLBBENCH_BASE   0x0000100000000000ULL
+#define TLBBENCH_PAGES  64
+#define TLBBENCH_ROUNDS 2000
+
+// Read one word from every page of the benchmark window
+static uint64_t tlbbench_touch(void) {
+    uint64_t sum = 0;
+    for (int i = 0; i < TLBBENCH_PAGES; i++) {
+        sum += *(volatile uint64_t*)(TLBBENCH_BASE + (uint64_t)i * PAGE_SIZE);
+    }
+    return sum;
+}
+
+void cmd_tlbbench(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    // Two address spaces map the same frames at the same lower-half address.
+    // Each round switches to the other one and touches every page, so the
+    // cost is the switch plus refilling whatever the TLB lost.
+    static vmm_space_t* spaces[2];
+    if (!spaces[0]) {
+        void* frames = pmm_alloc_pages(TLBBENCH_PAGES);
+        if (!frames) {
+            printk("tlbbench: out of memory\n");
+            return;
+        }
+        for (int i = 0; i < 2; i++) {
+            spaces[i] = vmm_space_create();
+            vmm_map_range(spaces[i]->pml4, TLBBENCH_BASE, (uint64_t)frames,
+                          TLBBENCH_PAGES * PAGE_SIZE, PTE_PRESENT | PTE_RW | PTE_NX);
+        }
+    }
+
+    vmm_space_t* home = vmm_space_current();
+    uint64_t sum = 0;
+
+    // Warm: with PCIDs both spaces keep their entries across switches
+    uint64_t start = rdtsc();
+    for (int r = 0; r < TLBBENCH_ROUNDS; r++) {
+        vmm_space_switch(spaces[r & 1]);
+        sum += tlbbench_touch();
+    }
+    uint64_t warm = rdtsc() - start;
+
+    // Cold: flush after every switch, as a CPU without PCIDs would
+    start = rdtsc();
+    for (int r = 0; r < TLBBENCH_ROUNDS; r++) {
+        vmm_space_switch(spaces[r & 1]);
+        vmm_tlb_flush_local();
+        sum += tlbbench_touch();
+    }
+    uint64_t cold = rdtsc() - start;
+
+    vmm_space_switch(home);
+    (void)sum;
+
+    draw_shell_box("TLB Benchmark");
+    printk("  %d switches, %d pages touched after each (PCID %s)\n\n",
+           TLBBENCH_ROUNDS, TLBBENCH_PAGES, vmm_pcid_enabled() ? "on" : "off");
+    printk("  TLB-warm switch: %llu cycles\n", warm / TLBBENCH_ROUNDS);
+    printk("  TLB-cold switch: %llu cycles\n\n", cold / TLBBENCH_ROUNDS);
+}
+
+#define FBBENCH_SWAPS 20
+
+// Time FBBENCH_SWAPS back-to-front copies; returns TSC cycles per swap
+static uint64_t fbbench_run(uint64_t* ms) {
+    uint64_t start_ms = timer_get_uptime_ms();
+    uint64_t start = rdtsc();
+    for (int i = 0; i < FBBENCH_SWAPS; i++) {
+        fb_swap();
+    }
+    uint64_t cycles = rdtsc() - start;
+    *ms = timer_get_uptime_ms() - start_ms;
+    return cycles / FBBENCH_SWAPS;
+}
+
+static void fbbench_report(const char* name, uint64_t cycles, uint64_t ms, uint64_t bytes) {
+    printk("  %-4s %llu cycles/swap", name, cycles);
+    if (ms > 0) {
+        printk(", %llu MB/s", bytes * FBBENCH_SWAPS / ms * 1000 / (1024 * 1024));
+    }
+    printk("\n");
+}
+
+void cmd_fbbench(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    framebuffer_t* fb = fb_get();
+    if (fb->backbuffer == fb->address) {
+        printk("fbbench: double buffering is off\n");
+        return;
+    }
+    uint64_t bytes = fb->height * fb->pitch;
+    uint64_t uc_ms, wc_ms;
+
+    draw_shell_box("Framebuffer Benchmark");
+    printk("  %d swaps of %llu KB\n\n", FBBENCH_SWAPS, bytes / 1024);
+
+    if (!vmm_wc_enabled()) {
+        uint64_t cycles = fbbench_run(&uc_ms);
+        fbbench_report("boot", cycles, uc_ms, bytes);
+        printk("\n  No PAT: the bootloader's memory type stays\n\n");
+        return;
+    }
+
+    // Uncached is the worst a bootloader could have left behind
+    fb_set_memory_type(PTE_UC);
+    uint64_t uc = fbbench_run(&uc_ms);
+    fb_set_memory_type(PTE_WC);
+    uint64_t wc = fbbench_run(&wc_ms);
+
+    fbbench_report("UC", uc, uc_ms, bytes);
+    fbbench_report("WC", wc, wc_ms, bytes);
+    printk("\n");
+}
+
+void cmd_slabinfo(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    draw_shell_box("Slab Caches");
+    printk("  %-12s %-6s %-6s %-14s %-6s %-6s %-7s %s\n",
+           "Name", "Size", "Stride", "Active/Total", "Slabs", "Pages", "Colours", "Allocs/Frees");
+
+    for (kmem_cache_t* cache = kmem_cache_list(); cache; cache = cache->next) {
+        printk("  %-12s %-6llu %-6llu %6llu/%-7llu %-6llu %-6u %-7u %llu/%llu\n",
+               cache->name, (uint64_t)cache->object_size, (uint64_t)cache->stride,
+               cache->active_objects, cache->total_objects, cache->slab_count,
+               cache->slab_pages, cache->colour_count, cache->allocs, cache->frees);
+    }
+    printk("\n  Frames held by slabs: %llu\n\n", pmm_get_owner_pages(PMM_OWNER_SLAB));
+}
+
+#define HEAPBENCH_SLOTS 512
+#define HEAPBENCH_OPS   50000
+
+static void* heapbench_slots[HEAPBENCH_SLOTS];
+
+// Random mix of kmalloc/kfree over a pool of live blocks, timing each call.
+// The worst case matters as much as the mean: it is time spent with the
+// heap lock held and interrupts off.
+void cmd_heapbench(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    uint64_t seed = rdtsc() | 1;
+    uint64_t alloc_total = 0, alloc_max = 0, allocs = 0;
+    uint64_t free_total = 0, free_max = 0, frees = 0;
+
+    for (int op = 0; op < HEAPBENCH_OPS; op++) {
+        // xorshift64
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        int slot = seed % HEAPBENCH_SLOTS;
+        if (heapbench_slots[slot]) {
+            uint64_t start = rdtsc();
+            kfree(heapbench_slots[slot]);
+            uint64_t cycles = rdtsc() - start;
+            heapbench_slots[slot] = NULL;
+            free_total += cycles;
+            if (cycles > free_max) free_max = cycles;
+            frees++;
+        } else {
+            // Mostly small objects, with the odd one of up to 64KB
+            size_t size = 16 + (seed >> 16) % ((seed >> 48) % 16 == 0 ? 65536 : 512);
+            uint64_t start = rdtsc();
+            void* ptr = kmalloc(size);
+            uint64_t cycles = rdtsc() - start;
+            if (!ptr) {
+                printk("Error: kmalloc(%llu) failed.\n", (uint64_t)size);
+                break;
+            }
+            memset(ptr, 0xA5, size < 64 ? size : 64);
+            heapbench_slots[slot] = ptr;
+            alloc_total += cycles;
+            if (cycles > alloc_max) alloc_max = cycles;
+            allocs++;
+        }
+    }
+
+    kheap_stats_t stats;
+    kheap_get_stats(&stats);
+
+    for (int i = 0; i < HEAPBENCH_SLOTS; i++) {
+        kfree(heapbench_slots[i]);
+        heapbench_slots[i] = NULL;
+    }
+
+    draw_shell_box("Heap Benchmark");
+    printk("  %d operations over %d slots\n\n", HEAPBENCH_OPS, HEAPBENCH_SLOTS);
+    printk("  kmalloc: %llu calls, avg %llu cycles, worst %llu\n",
+           allocs, allocs ? alloc_total / allocs : 0, alloc_max);
+    printk("  kfree:   %llu calls, avg %llu cycles, worst %llu\n\n",
+           frees, frees ? free_total / frees : 0, free_max);
+    printk("  After the run: %llu KB heap, %llu used blocks, %llu free blocks\n",
+           stats.heap_size / 1024, stats.used_blocks, stats.free_blocks);
+    printk("  Largest free block: %llu KB\n\n", stats.largest_free / 1024);
+}
+
+#define HEAPSTAT_TOP 10
+
+static kheap_site_t heapstat_sites[KHEAP_PROFILE_SITES];
+
+void cmd_heapstat(int argc, char **argv) {
+    if (argc > 1) {
+        if (strcmp(argv[1], "on") == 0) {
+            kheap_profile_enable(1);
+            printk("Heap profiling on\n");
+        } else if (strcmp(argv[1], "off") == 0) {
+            kheap_profile_enable(0);
+            printk("Heap profiling off\n");
+        } else {
+            printk("Usage: heapstat [on|off]\n");
+        }
+        return;
+    }
+
+    kheap_stats_t hs;
+    kheap_get_stats(&hs);
+
+    draw_shell_box("Heap Statistics");
+    printk("  Heap:     %llu KB, %llu KB used in %llu blocks, %llu KB free in %llu blocks\n",
+           hs.heap_size / 1024, hs.used_bytes / 1024, hs.used_blocks,
+           hs.free_bytes / 1024, hs.free_blocks);
+    printk("  Large:    %llu allocations of %d KB and up, %llu KB, outside the heap\n",
+           hs.large_count, KHEAP_LARGE_THRESHOLD / 1024, hs.large_bytes / 1024);
+    printk("  Largest free block: %llu KB, fragmentation: %llu%%\n\n",
+           hs.largest_free / 1024,
+           hs.free_bytes ? 100 - hs.largest_free * 100 / hs.free_bytes : 0);
+
+    printk("  %-9s %-8s %s\n", "Size", "Used", "Free");
+    for (int b = 0; b < KHEAP_HIST_BUCKETS; b++) {
+        if (hs.used_hist[b] + hs.free_hist[b] == 0) continue;
+        uint64_t size = 16ULL << b;
+        if (size >= 1024 * 1024) {
+            printk("  %-3lluMB%s  %-8llu %llu\n", size >> 20, b == KHEAP_HIST_BUCKETS - 1 ? "+" : " ",
+                   hs.used_hist[b], hs.free_hist[b]);
+        } else if (size >= 1024) {
+            printk("  %-3lluKB    %-8llu %llu\n", size >> 10, hs.used_hist[b], hs.free_hist[b]);
+        } else {
+            printk("  %-3lluB     %-8llu %llu\n", size, hs.used_hist[b], hs.free_hist[b]);
+        }
+    }
+    printk("\n");
+
+    if (!kheap_profile_enabled()) {
+        printk("  Profiling is off ('heapstat on' to record allocation sites)\n\n");
+        return;
+    }
+
+    uint64_t dropped;
+    uint32_t count = kheap_get_sites(heapstat_sites, KHEAP_PROFILE_SITES, &dropped);
+    uint64_t now = timer_get_uptime_ms();
+
+    printk("  Top allocators by live bytes (%u sites, %llu untracked allocations):\n",
+           count, dropped);
+    printk("  %-18s %-9s %-7s %-8s %-8s %-13s %s\n",
+           "Caller", "Live KB", "Blocks", "Allocs", "Frees", "Sizes", "Allocs/s");
+
+    // Selection sort of the first few is all a short list needs
+    for (uint32_t i = 0; i < count && i < HEAPSTAT_TOP; i++) {
+        uint32_t best = i;
+        for (uint32_t j = i + 1; j < count; j++) {
+            if (heapstat_sites[j].live_bytes > heapstat_sites[best].live_bytes) best = j;
+        }
+        kheap_site_t site = heapstat_sites[best];
+        heapstat_sites[best] = heapstat_sites[i];
+        heapstat_sites[i] = site;
+
+        uint64_t span = now - site.first_ms;
+        printk("  0x%-16llx %-9llu %-7llu %-8llu %-8llu %6llu-%-6llu %llu\n",
+               site.caller, site.live_bytes / 1024, site.live_blocks, site.allocs, site.frees,
+               site.min_size, site.max_size, span ? site.allocs * 1000 / span : site.allocs);
+    }
+    printk("\n");
+}
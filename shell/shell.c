@@ -34,6 +34,14 @@ static shell_command_t commands[] = {
     {"ls",        "List files in Ramdisk",               cmd_ls},
     {"cat",       "Print file contents",                 cmd_cat},
     {"bitmap",    "Draw a bitmap image on screen",       cmd_img},
+    {"buddyinfo", "Show free page blocks per order",     cmd_buddyinfo},
+    {"bitbench",  "Benchmark bitmap search routines",    cmd_bitbench},
+    {"vmstat",    "Show virtual memory counters",        cmd_vmstat},
+    {"tlbbench",  "Benchmark address space switches",    cmd_tlbbench},
+    {"fbbench",   "Benchmark framebuffer swaps (UC/WC)", cmd_fbbench},
+    {"slabinfo",  "Show slab cache statistics",          cmd_slabinfo},
+    {"heapbench", "Benchmark kmalloc/kfree latency",     cmd_heapbench},
+    {"heapstat",  "Heap histogram and allocation sites", cmd_heapstat},
     {NULL, NULL, NULL}  // Sentinel
 };
 
@@ -39,6 +39,14 @@ void cmd_history(int argc, char **argv);
 void cmd_ls(int argc, char **argv);
 void cmd_cat(int argc, char **argv);
 void cmd_img(int argc, char **argv);
+void cmd_buddyinfo(int argc, char **argv);
+void cmd_bitbench(int argc, char **argv);
+void cmd_vmstat(int argc, char **argv);
+void cmd_tlbbench(int argc, char **argv);
+void cmd_fbbench(int argc, char **argv);
+void cmd_slabinfo(int argc, char **argv);
+void cmd_heapbench(int argc, char **argv);
+void cmd_heapstat(int argc, char **argv);
 
 int shell_get_history_count(void);
 const char* shell_get_history_item(int index);